@@ -1,4 +1,21 @@
 
 #include <adel.h>
 
-AdelRuntime * AdelRuntime::curStack = 0;
+// -- The per-core ones start out zero, like all statics
+ADEL_PER_CORE(AdelRuntime *) AdelRuntime::curStack;
+ADEL_PER_CORE(uint32_t) AdelRuntime::loop_wake;
+ADEL_PER_CORE(bool) AdelRuntime::loop_has_wake;
+ADEL_PER_CORE(adel_epoch_t) AdelRuntime::loop_epoch;
+
+volatile adel_epoch_t AdelEvent::epoch = 0;
+ADEL_PER_CORE(uint32_t) AdelRuntime::now_ms;
+ADEL_PER_CORE(uint32_t) AdelRuntime::now_us;
+ADEL_PER_CORE(bool) AdelRuntime::have_us;
+uint32_t AdelRuntime::pass_budget = 0;
+
+#ifdef ADEL_WORKERS
+// -- The thread that starts the workers is number 0
+thread_local uint8_t adel_worker_id = 0;
+std::mutex AdelExecutor::park_lock;
+std::condition_variable AdelExecutor::park_cv;
+#endif
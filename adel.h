@@ -19,7 +19,177 @@
 #ifndef ADEL_V4
 #define ADEL_V4
 
+// -- Program counters of the end of every Adel function (see afinish) and
+//    of its cleanup code (see aonstop). The first construct is step 3.
+#ifdef ADEL_LINE_PCS
 #define ADEL_FINALLY 0xFFFF
+#define ADEL_STOP 0xFFFE
+#else
+#define ADEL_FINALLY 1
+#define ADEL_STOP 2
+#endif
+
+// -- Type of the program counter. Each construct takes up one step (some
+//    take three), so this allows over 200 constructs per function. Define
+//    it as uint16_t before including adel.h if you need more.
+#ifndef ADEL_PC_TYPE
+#ifdef ADEL_LINE_PCS
+#define ADEL_PC_TYPE uint16_t
+#else
+#define ADEL_PC_TYPE uint8_t
+#endif
+#endif
+
+/** Cores
+ *
+ *  On dual-core chips (ESP32, RP2040), each core can run its own top-level
+ *  Adel functions. Everything the runtime keeps about the current pass --
+ *  which runtime is running, the time, the earliest wake-up -- is kept
+ *  once per core, in an AdelPerCore, so the cores never see each other's
+ *  passes. A runtime, and the ARs in its tree, must stay on one core.
+ *
+ *  ADEL_CORES comes from the board, because adel.cpp has to agree with
+ *  the sketch about it. To override it, define it for the whole build, not
+ *  just in the sketch. ADEL_CORE_ID() is the number of the running core.
+ *
+ *  With ADEL_WORKERS defined (for the whole build, too), each worker
+ *  thread of an AdelExecutor counts as a core, and the thread that starts
+ *  them as one more.
+ */
+#ifdef ADEL_WORKERS
+extern thread_local uint8_t adel_worker_id;
+#define ADEL_CORES (ADEL_WORKERS + 1)
+#define ADEL_CORE_ID()  adel_worker_id
+#endif
+
+#ifndef ADEL_CORES
+#if defined(ARDUINO_ARCH_ESP32) && ! defined(CONFIG_FREERTOS_UNICORE)
+#define ADEL_CORES 2
+#elif defined(ARDUINO_ARCH_RP2040)
+#define ADEL_CORES 2
+#else
+#define ADEL_CORES 1
+#endif
+#endif
+
+#ifndef ADEL_CORE_ID
+#if ADEL_CORES == 1
+#define ADEL_CORE_ID()  0
+#elif defined(ARDUINO_ARCH_ESP32)
+#define ADEL_CORE_ID()  xPortGetCoreID()
+#elif defined(ARDUINO_ARCH_RP2040)
+#define ADEL_CORE_ID()  rp2040.cpuid()
+#endif
+#endif
+
+#if ADEL_CORES > 1
+
+// -- One T for each core. It converts to and from T, so code that uses
+//    the value does not need to know that there is more than one.
+template <typename T>
+class AdelPerCore
+{
+private:
+  T v[ADEL_CORES];
+
+public:
+  inline T & get() { return v[ADEL_CORE_ID()]; }
+  inline operator T & () { return get(); }
+  inline T & operator=(T x) { return get() = x; }
+  inline T operator->() { return get(); }
+};
+
+#define ADEL_PER_CORE(T)  AdelPerCore<T>
+
+#else
+
+#define ADEL_PER_CORE(T)  T
+
+#endif
+
+/** AdelLock
+ *
+ *  Keeps interrupt handlers -- and on dual-core chips, the other core --
+ *  away from shared data. On a single core this just turns interrupts off
+ *  and on again. On ESP32 it is a FreeRTOS spinlock, and on RP2040 one of
+ *  the hardware spinlocks; both also turn interrupts off on this core, and
+ *  both can be used from an interrupt handler.
+ */
+#if ADEL_CORES > 1 && defined(ARDUINO_ARCH_ESP32)
+
+class AdelLock
+{
+private:
+  portMUX_TYPE mux;
+
+public:
+  AdelLock() { portMUX_INITIALIZE(& mux); }
+  inline void lock() { portENTER_CRITICAL_SAFE(& mux); }
+  inline void unlock() { portEXIT_CRITICAL_SAFE(& mux); }
+};
+
+#elif ADEL_CORES > 1 && defined(ARDUINO_ARCH_RP2040) && ! defined(ADEL_WORKERS)
+
+#include <hardware/sync.h>
+
+class AdelLock
+{
+private:
+  spin_lock_t * spin;
+  uint32_t saved;
+
+public:
+  AdelLock()
+    : spin(spin_lock_instance(next_striped_spin_lock_num())),
+      saved(0)
+  {}
+  inline void lock() { saved = spin_lock_blocking(spin); }
+  inline void unlock() { spin_unlock(spin, saved); }
+};
+
+#elif defined(ADEL_WORKERS)
+
+// -- On a host there are no interrupt handlers, only other threads
+#include <mutex>
+
+class AdelLock
+{
+private:
+  std::mutex m;
+
+public:
+  inline void lock() { m.lock(); }
+  inline void unlock() { m.unlock(); }
+};
+
+#else
+
+class AdelLock
+{
+public:
+  inline void lock() { noInterrupts(); }
+  inline void unlock() { interrupts(); }
+};
+
+#endif
+
+/** ADEL_CORE_WAKE
+ *
+ *  Wakes the other core, if it is asleep in aidle, when something that it
+ *  might be waiting for happens (see AdelEvent). RP2040 sleeps with WFE,
+ *  which the SEV instruction on either core ends, and idle workers of an
+ *  AdelExecutor wait on a condition variable.
+ */
+#ifndef ADEL_CORE_WAKE
+#if defined(ADEL_WORKERS)
+inline void adel_workers_wake();
+#define ADEL_CORE_WAKE()  adel_workers_wake()
+#elif ADEL_CORES > 1 && defined(ARDUINO_ARCH_RP2040)
+#define ADEL_CORE_WAKE()  __asm__ volatile ("sev")
+#else
+#define ADEL_CORE_WAKE()
+#endif
+#endif
 
 /** adel status
  * 
@@ -47,58 +217,470 @@ public:
   bool notdone() const { return m_status == ACONT || m_status == AYIELD; }
 };
 
+/** Adel activation record pool
+ *
+ *  By default, activation records are allocated on the heap. On small
+ *  devices, a long-running program that creates and deletes ARs over and
+ *  over can fragment the heap until an allocation fails. Defining
+ *  ADEL_AR_POOL_BYTES before including adel.h sets aside a static region of
+ *  that many bytes, which is carved into power-of-two slots on demand:
+ *
+ *     #define ADEL_AR_POOL_BYTES 1024
+ *     #include <adel.h>
+ *
+ *  Freed slots go on a free list for their size class and are only ever
+ *  reused for ARs of the same class, so allocation and deallocation are
+ *  both O(1) and the pool never fragments. When the pool runs out, Adel
+ *  calls ADEL_AR_POOL_FAIL(size), which by default stops the program at
+ *  that point. Define it before including adel.h to do something else,
+ *  such as logging and resetting the board, but it must not return: the
+ *  function call that ran out would give back a null AR, which Adel
+ *  does not check for.
+ */
+#ifdef ADEL_AR_POOL_BYTES
+
+#ifndef ADEL_AR_POOL_MIN_SLOT
+#define ADEL_AR_POOL_MIN_SLOT 16
+#endif
+
+#ifndef ADEL_AR_POOL_CLASSES
+#define ADEL_AR_POOL_CLASSES 5
+#endif
+
+#ifndef ADEL_AR_POOL_FAIL
+#ifdef ADEL_DEBUG
+#define ADEL_AR_POOL_FAIL(size)						\
+  Serial.print("adel pool exhausted: ");				\
+  Serial.println((unsigned) size);					\
+  while (1) ;
+#else
+#define ADEL_AR_POOL_FAIL(size)   while (1) ;
+#endif
+#endif
+
+class AdelPool
+{
+private:
+  // -- Free slots are linked through their first word
+  struct Slot { Slot * next; };
+
+  // -- The storage itself, and the free list head for each size class.
+  //    These are function-local statics so that the pool lives entirely
+  //    in the header, where ADEL_AR_POOL_BYTES is visible. Each core has
+  //    a pool of its own, so neither one ever has to wait for the other.
+  static inline uint8_t * storage() {
+    static uint8_t s[ADEL_CORES][ADEL_AR_POOL_BYTES] __attribute__((aligned));
+    return s[ADEL_CORE_ID()];
+  }
+
+  static inline Slot ** free_list() {
+    static Slot * heads[ADEL_CORES][ADEL_AR_POOL_CLASSES];
+    return heads[ADEL_CORE_ID()];
+  }
+
+  // -- Number of bytes at the front of the storage already cut into slots
+  static inline size_t & carved() {
+    static size_t c[ADEL_CORES];
+    return c[ADEL_CORE_ID()];
+  }
+
+  // -- Size class for a request: slot size is MIN_SLOT << class
+  static inline uint8_t size_class(size_t size) {
+    uint8_t c = 0;
+    size_t slot = ADEL_AR_POOL_MIN_SLOT;
+    while (slot < size && c < ADEL_AR_POOL_CLASSES) {
+      slot <<= 1;
+      c++;
+    }
+    return c;
+  }
+
+public:
+  // -- Get a slot big enough for size bytes, or 0 if there is none
+  static inline void * tryAllocate(size_t size) {
+    uint8_t c = size_class(size);
+    if (c < ADEL_AR_POOL_CLASSES) {
+      Slot * s = free_list()[c];
+      if (s) {
+        free_list()[c] = s->next;
+        return s;
+      }
+      size_t slot = ((size_t) ADEL_AR_POOL_MIN_SLOT) << c;
+      if (carved() + slot <= ADEL_AR_POOL_BYTES) {
+        s = (Slot *) (storage() + carved());
+        carved() += slot;
+        return s;
+      }
+    }
+    return 0;
+  }
+
+  // -- Same, but calling ADEL_AR_POOL_FAIL when the pool is out of room
+  static inline void * allocate(size_t size) {
+    void * p = tryAllocate(size);
+    if ( ! p) {
+      ADEL_AR_POOL_FAIL(size);
+    }
+    return p;
+  }
+
+  // -- Return a slot to the free list for its size class
+  static inline void release(void * p, size_t size) {
+    Slot * s = (Slot *) p;
+    uint8_t c = size_class(size);
+    s->next = free_list()[c];
+    free_list()[c] = s;
+  }
+
+  // -- Bytes that have never been carved into slots
+  static inline size_t uncarved() { return ADEL_AR_POOL_BYTES - carved(); }
+};
+
+#endif
+
+/** Spare activation records
+ *
+ *  Loops like this one create and delete ARs of exactly the same type on
+ *  every iteration:
+ *
+ *     while (1) {
+ *       auntil( waitbutton(BUTTON_PIN), rampuplight(LED_PIN, howlong) );
+ *       ...
+ *
+ *  When not using the pool, Adel keeps the memory of the last few deleted
+ *  ARs instead of returning it to the heap, and builds the next AR of the
+ *  same size right in that memory. In a loop that keeps calling the same
+ *  functions, the heap is no longer touched at all. ADEL_AR_SPARES sets
+ *  how many are kept (0 turns this off).
+ */
+#ifndef ADEL_AR_SPARES
+#define ADEL_AR_SPARES 4
+#endif
+
+#if ! defined(ADEL_AR_POOL_BYTES) && ADEL_AR_SPARES > 0
+
+class AdelSpares
+{
+private:
+  struct Spare {
+    void * mem;
+    size_t size;
+  };
+
+  // -- One set for each core (see AdelPool)
+  static inline Spare * spares() {
+    static Spare s[ADEL_CORES][ADEL_AR_SPARES];
+    return s[ADEL_CORE_ID()];
+  }
+
+public:
+  // -- Reuse a spare of exactly this size, if there is one
+  static inline void * allocate(size_t size) {
+    Spare * s = spares();
+    for (uint8_t i = 0; i < ADEL_AR_SPARES; i++) {
+      if (s[i].mem && s[i].size == size) {
+        void * p = s[i].mem;
+        s[i].mem = 0;
+        return p;
+      }
+    }
+    return ::operator new(size);
+  }
+
+  // -- Keep the memory of a deleted AR, if there is room
+  static inline void release(void * p, size_t size) {
+    Spare * s = spares();
+    for (uint8_t i = 0; i < ADEL_AR_SPARES; i++) {
+      if ( ! s[i].mem) {
+        s[i].mem = p;
+        s[i].size = size;
+        return;
+      }
+    }
+    ::operator delete(p);
+  }
+};
+
+#endif
+
+/** AR accounting
+ *
+ *  With ADEL_AR_STATS defined, each runtime counts the ARs in its tree and
+ *  the bytes they take up, and remembers the most it has had at once (see
+ *  AdelRuntime::maxBytes). An AR is counted against the current runtime
+ *  when it is created and when it is deleted, which is always the runtime
+ *  whose tree it belongs to. The sizes are those of the ARs themselves,
+ *  not of the pool slots or heap blocks that hold them.
+ */
+#ifdef ADEL_AR_STATS
+
+class AdelStats
+{
+public:
+  uint16_t ars;
+  uint16_t max_ars;
+  uint32_t bytes;
+  uint32_t max_bytes;
+
+  AdelStats()
+    : ars(0),
+      max_ars(0),
+      bytes(0),
+      max_bytes(0)
+  {}
+
+  inline void created(size_t size) {
+    ars++;
+    bytes += size;
+    if (ars > max_ars) max_ars = ars;
+    if (bytes > max_bytes) max_bytes = bytes;
+  }
+
+  inline void deleted(size_t size) {
+    ars--;
+    bytes -= size;
+  }
+};
+
+// -- Defined after AdelRuntime
+inline void adel_ar_created(size_t size);
+inline void adel_ar_deleted(size_t size);
+
+#else
+
+#define adel_ar_created(size)
+#define adel_ar_deleted(size)
+
+#endif
+
 /** Adel activation record
  *
  *  The base class for all activation records. All other information --
  *  including the code to run -- is bound up in the closure stored in each
  *  subclass.
+ *
+ *  There are no virtual functions. Instead, each AR holds a pointer to a
+ *  step function, generated by the LocalAdelAR template for its lambda,
+ *  which runs the lambda, stops it, or deletes the AR. This costs the same
+ *  one pointer per AR as a vtable pointer, but there are no vtables in
+ *  flash, and each pass makes one indirect call per AR, which the
+ *  compiler can inline the lambda into.
  */
 class AdelAR
 {
+public:
+  enum { ARUN, ASTOP, ADESTROY, ASAVE, ALOAD };
+  typedef astatus (*Step)(AdelAR * ar, uint8_t op);
+
+#ifdef ADEL_AR_POOL_BYTES
+  // -- Both "new" in aend and "delete" in clear come here. The step
+  //    function deletes the AR as its actual LocalAdelAR type, so we get
+  //    the right size. It is noexcept so that if ADEL_AR_POOL_FAIL does
+  //    return, "new" just gives back null without building anything.
+  static inline void * operator new(size_t size) noexcept {
+    return AdelPool::allocate(size);
+  }
+  static inline void operator delete(void * p, size_t size) {
+    AdelPool::release(p, size);
+  }
+#elif ADEL_AR_SPARES > 0
+  // -- Same idea, but recycling the memory of recently deleted ARs
+  static inline void * operator new(size_t size) {
+    return AdelSpares::allocate(size);
+  }
+  static inline void operator delete(void * p, size_t size) {
+    AdelSpares::release(p, size);
+  }
+#else
+  // -- Declaring the form below hides the global ones, so say so
+  static inline void * operator new(size_t size) {
+    return ::operator new(size);
+  }
+  static inline void operator delete(void * p) {
+    ::operator delete(p);
+  }
+#endif
+
+  // -- Build an AR in memory that is already there (see afork)
+  static inline void * operator new(size_t, void * where) { return where; }
+  static inline void operator delete(void *, void *) {}
+
+private:
+  friend class AdelRuntime;
+  friend class AdelChildren;
+  friend class AdelSleepers;
+
+  // -- Code for this AR (see LocalAdelAR)
+  Step step;
+
+  // -- Next child of the same parent (see AdelChildren)
+  AdelAR * sibling;
+
+  // -- Whether this AR (and everything below it) was asleep at the end of
+  //    its last run: not at all, until the notbefore time, or until some
+  //    AdelEvent is signaled. The byte goes last, so that on 32-bit chips
+  //    small closures can use the padding after it.
+  uint32_t notbefore;
+  enum { ARUNNABLE, ATIMED, AEVENT };
+  uint8_t parked;
+
+protected:
+  AdelAR(Step s)
+    : step(s),
+      sibling(0),
+      notbefore(0),
+      parked(ARUNNABLE)
+  {}
+
+  // -- Only the step function deletes ARs (see destroy)
+  ~AdelAR() {}
+
+public:
+  // -- Delete an AR, and the ARs of all of its children functions
+  static inline void destroy(AdelAR * ar) { ar->step(ar, ADESTROY); }
+
+  // -- Run the function's aonstop code, if it has any and it was started
+  //    but not finished. Called just before an unfinished AR is deleted.
+  static inline void stop(AdelAR * ar) { ar->step(ar, ASTOP); }
+
+  // -- Run the adel function one time, by way of the step function
+  inline astatus run() { return step(this, ARUN); }
+
+#ifdef ADEL_SNAPSHOT
+  // -- Copy the function's closure out to, or back in from, the memory
+  //    offered to AdelImage (see asave and aresume)
+  static inline bool save(AdelAR * ar) { return ar->step(ar, ASAVE).done(); }
+  static inline bool load(AdelAR * ar) { return ar->step(ar, ALOAD).done(); }
+#endif
+};
+
+/** AdelChildren
+ *
+ *  Callees that are running concurrently (see aboth or aall, for example)
+ *  are kept in a list, in the order they were started, linked through
+ *  their sibling pointers. The list (its head, and its tail, so that
+ *  starting each child takes constant time) is one of the variables
+ *  declared by abegin, so like the others it only takes up space in the
+ *  activation records of functions that actually call other functions.
+ *
+ *  The list owns the children: clearing it, or deleting the AR it lives
+ *  in, deletes them. Children that are not done yet (because auntil or
+ *  aforatmost gave up on them, for example) are stopped first, so their
+ *  aonstop code runs, before their own children are. Copying a list
+ *  (which happens only while the lambda is being set up, before there
+ *  are any children) gives an empty one.
+ */
+class AdelChildren
+{
 private:
-  // -- Each Adel function can have up three callees running simulatenously
-  //    (see athree, for example)
-  AdelAR * children[3];
+  friend class AdelSleepers;
+  AdelAR * first;
+  AdelAR * last;
 
 public:
-  AdelAR() {
-    children[0] = 0;
-    children[1] = 0;
-    children[2] = 0;
-  }
+  AdelChildren() : first(0), last(0) {}
+  AdelChildren(const AdelChildren &) : first(0), last(0) {}
+  ~AdelChildren() { clear(); }
 
-  // -- Clear a particular child function, deleting its activation record
-  inline void clear(int i) {
-    AdelAR * ch = children[i];
-    if (ch) {
-      children[i] = 0;
-      delete ch;
+  // -- Clear all child functions, deleting their activation records
+  inline void clear() {
+    while (first) {
+      AdelAR * ch = first;
+      first = ch->sibling;
+      AdelAR::stop(ch);
+      AdelAR::destroy(ch);
     }
+    last = 0;
   }
 
   // -- Initialize a child function. Typically, the "ar" argument is the
   //    result of calling a user's function, which creates the new AR with
-  //    the lambda inside it.
+  //    the lambda inside it. Children are numbered in the order they are
+  //    started, and starting child 0 clears any left from before.
   inline void init(int i, AdelAR * ar) {
-    clear(i);
-    children[i] = ar;
+    if (i == 0) {
+      clear();
+      first = ar;
+    } else
+      last->sibling = ar;
+    last = ar;
+  }
+
+  // -- Child number i
+  inline AdelAR * child(int i) const {
+    AdelAR * ch = first;
+    while (i--) ch = ch->sibling;
+    return ch;
   }
 
-  // -- Run the adel function one time. Each local AR overrides this
-  //    function to invoke its lambda.
-  virtual astatus run() = 0;
+  // -- Run child number i once, by way of the runtime, which skips
+  //    children that are known to be asleep
+  inline astatus runchild(int i) const;
+
+  // -- Run all of the children once. Returns ADONE only when every one of
+  //    them is done (see aall).
+  inline astatus runall() const;
+
+  // -- Run all of the children once. Returns the number of the first one
+  //    that is done, or -1 if none of them are (see aany).
+  inline int runany() const;
+};
+
+#ifdef ADEL_SNAPSHOT
+/** AdelImage
+ *
+ *  Memory offered for saving or loading one closure (see asave), in the
+ *  same way that AdelPlace offers memory for building one AR. Only plain
+ *  bytes can be copied: a closure with a list of children, or any other
+ *  variable with a copy constructor of its own, cannot be, since the
+ *  pointers inside would mean nothing after the next boot.
+ */
+class AdelImage
+{
+private:
+  struct Offer {
+    void * mem;
+    size_t size;
+  };
 
-  // -- Most of the time, the parent AR calls run
-  inline astatus runchild(int i) const { return children[i]->run(); }
+  static inline Offer & offer() {
+    static Offer o[ADEL_CORES];
+    return o[ADEL_CORE_ID()];
+  }
+
+public:
+  static inline void give(void * mem, size_t size) {
+    offer().mem = mem;
+    offer().size = size;
+  }
 
-  // -- Delete this AR, and the ARs of all of its children functions
-  virtual ~AdelAR() {
-    clear(0);
-    clear(1);
-    clear(2);
+  // -- Copy size bytes of closure out to the offered memory, if they fit,
+  //    or in from it, if it holds exactly that many. Afterwards the offer
+  //    holds the size copied.
+  static inline astatus copy(void * body, size_t size, bool plain, bool out) {
+    Offer & o = offer();
+    if ( ! plain || ! o.mem || (out ? size > o.size : size != o.size))
+      return astatus::ANONE;
+    if (out)
+      memcpy(o.mem, body, size);
+    else
+      memcpy(body, o.mem, size);
+    o.mem = 0;
+    o.size = size;
+    return astatus::ADONE;
   }
+
+  static inline size_t copied() { return offer().size; }
 };
 
+#define adel_image_copy(self, op)					\
+  if (op >= ASAVE)							\
+    return AdelImage::copy(& self->body, sizeof(T),			\
+                           __is_trivially_copyable(T), op == ASAVE);
+#else
+#define adel_image_copy(self, op)
+#endif
+
 /** LocalAdelAR
  *
  *  This class is the key to supporting local variables in a natural
@@ -108,7 +690,8 @@ public:
  *  that persist as the function makes progress.
  *
  *  The templating is necessary to get around the fact that C++11/14 do not
- *  allow you to declare the type of a lambda.
+ *  allow you to declare the type of a lambda. It also gives us a separate
+ *  step function for each lambda type, which stands in for a vtable.
  */
 template<typename T>
 class LocalAdelAR : public AdelAR
@@ -116,141 +699,2159 @@ class LocalAdelAR : public AdelAR
 public:
   T body;
   
- LocalAdelAR(const T& the_lambda)
-   : AdelAR(),
+ LocalAdelAR(const T& the_lambda, Step s = & LocalAdelAR<T>::stepfn)
+   : AdelAR(s),
      body(the_lambda)
   {}
 
-  // -- Invoke the lambda, passing its own AR pointer, so it can create and
-  //    attach ARs for children functions.
-  virtual astatus run() { return body(this); }
+  // -- Run the lambda directly, when the caller knows the type (see
+  //    afork). This hides AdelAR::run, which goes by the step function.
+  inline astatus run() { return body(false); }
+
+  // -- Invoke the lambda, to run it or to stop it (see aonstop). Or delete
+  //    the AR, as its real type, so that the lambda's captured variables
+  //    are destroyed, including the list of children (see AdelChildren).
+  static astatus stepfn(AdelAR * ar, uint8_t op) {
+    LocalAdelAR<T> * self = static_cast<LocalAdelAR<T> *>(ar);
+    adel_image_copy(self, op)
+    if (op != ADESTROY)
+      return self->body(op == ASTOP);
+    adel_ar_deleted(sizeof(LocalAdelAR<T>));
+    delete self;
+    return astatus::ANONE;
+  }
+
+  // -- The same, for an AR that lives in an afork slot: only destroy it,
+  //    since its memory belongs to the parent
+  static astatus placedstepfn(AdelAR * ar, uint8_t op) {
+    LocalAdelAR<T> * self = static_cast<LocalAdelAR<T> *>(ar);
+    adel_image_copy(self, op)
+    if (op != ADESTROY)
+      return self->body(op == ASTOP);
+    self->~LocalAdelAR<T>();
+    return astatus::ANONE;
+  }
 };
 
-/** Runtime stack
+/** AR placement
  *
- * This class encapsulates a single control stack. Activation records are
- * structured as a tree, since multiple functions can be active at the same
- * time. Each pass over the currently active functions starts with a call
- * to run() on the root. The top-level loop macros, such as aonce and
- * arepeat, each create a separate instance of this class to hold their
- * activation records.
+ *  Normally aend puts each new AR on the heap (or in the pool). Just
+ *  before afork calls one of its child functions, it offers the memory of
+ *  that child's slot here, and the child's aend builds its AR there
+ *  instead, if the size is right. The offer is only good for one AR.
+ *  ARs built in place are not counted by ADEL_AR_STATS, since their
+ *  bytes are already part of the parent's.
  */
-class AdelRuntime
+class AdelPlace
 {
+private:
+  struct Offer {
+    void * mem;
+    size_t size;
+  };
+
+  static inline Offer & offer() {
+    static Offer o[ADEL_CORES];
+    return o[ADEL_CORE_ID()];
+  }
+
 public:
+  static inline void give(void * mem, size_t size) {
+    offer().mem = mem;
+    offer().size = size;
+  }
+
+  static inline void * take(size_t size) {
+    Offer & o = offer();
+    void * mem = o.mem;
+    if ( ! mem || o.size != size) return 0;
+    o.mem = 0;
+    return mem;
+  }
+};
 
-  // -- Global pointer to the current stack
-  static AdelRuntime * curStack;
+// -- Make the AR for a lambda (see aend)
+template<typename T>
+inline LocalAdelAR<T> * adel_new(const T & body)
+{
+  void * mem = AdelPlace::take(sizeof(LocalAdelAR<T>));
+  if (mem)
+    return new (mem) LocalAdelAR<T>(body, & LocalAdelAR<T>::placedstepfn);
+  adel_ar_created(sizeof(LocalAdelAR<T>));
+  return new LocalAdelAR<T>(body);
+}
+
+/** AdelEvent
+ *
+ *  An event flag that can be signaled from an interrupt handler and waited
+ *  for with awaitevent. Unlike await, a function waiting for an event is
+ *  not run at all until the event is signaled:
+ *
+ *     AdelEvent pressed;
+ *     void onPress() { pressed.signal(); }
+ *     ...
+ *     attachInterrupt(digitalPinToInterrupt(2), onPress, RISING);
+ *
+ *  Signaling an event that nobody is waiting for is remembered until the
+ *  next awaitevent; signaling it twice before then counts as once.
+ */
+// -- Count of signals. It must not come back around to the same value
+//    between two passes, or the runtime would miss an event, so it is 16
+//    bits on AVR (read with interrupts off) and 32 bits elsewhere.
+#if defined(__AVR__)
+typedef uint16_t adel_epoch_t;
+#else
+typedef uint32_t adel_epoch_t;
+#endif
 
+class AdelEvent
+{
 private:
-  // -- Root of this tree of activation records
-  AdelAR * root;
+  volatile bool fired;
+
+  // -- Bumped on every signal of any event, so the runtime can tell when
+  //    something might have woken up
+  static volatile adel_epoch_t epoch;
+
+  static inline void bump() {
+#if defined(__AVR__)
+    uint8_t oldSREG = SREG;
+    cli();
+    epoch++;
+    SREG = oldSREG;
+#elif defined(ADEL_WORKERS)
+    __atomic_add_fetch(& epoch, 1, __ATOMIC_SEQ_CST);
+#else
+    epoch++;
+#endif
+  }
+
+public:
+  // -- The count of signals so far
+  static inline adel_epoch_t current() {
+#if defined(__AVR__)
+    uint8_t oldSREG = SREG;
+    cli();
+    adel_epoch_t e = epoch;
+    SREG = oldSREG;
+    return e;
+#elif defined(ADEL_WORKERS)
+    return __atomic_load_n(& epoch, __ATOMIC_SEQ_CST);
+#else
+    return epoch;
+#endif
+  }
+
+  AdelEvent()
+    : fired(false)
+  {}
+
+  // -- Safe to call from an interrupt handler, or from the other core
+  inline void signal() {
+    fired = true;
+    bump();
+    ADEL_CORE_WAKE();
+  }
+
+  // -- Consume the signal, if there is one
+  inline bool take() {
+    if (fired) {
+      fired = false;
+      return true;
+    }
+    return false;
+  }
+
+  inline bool signaled() const { return fired; }
+
+  // -- Wake every function waiting for an event, without signaling any
+  //    particular one (the channels use this)
+  static inline void notify() {
+    bump();
+    ADEL_CORE_WAKE();
+  }
+};
+
+/** AdelChannel
+ *
+ *  A queue of up to N values of type T, for passing messages between Adel
+ *  functions (see asend and areceive). The values are stored in the
+ *  channel itself, so it never allocates memory. A function that sends to
+ *  a full channel, or receives from an empty one, is not run again until
+ *  something is received from or sent to that channel (or some other
+ *  function is woken up). The channel remembers that someone is waiting,
+ *  and only then does the next send or receive wake the runtimes (see
+ *  AdelEvent::notify), so a busy channel that nobody waits on does not
+ *  keep sleeping functions elsewhere from being skipped.
+ *
+ *  An interrupt handler can send with trySend, which never waits; it just
+ *  returns false when the channel is full. Everywhere else, use send or
+ *  asend, which hold an AdelLock while they update the channel. On
+ *  dual-core chips the lock also keeps out the other core, so functions
+ *  on both cores can use the same channel, and interrupt handlers should
+ *  use send instead of trySend.
+ *
+ *     AdelChannel<char, 16> keys;
+ *     ...
+ *     areceive( keys, c );
+ *
+ *  The lock is a base class so that, where it has no state of its own, it
+ *  takes up no room in the channel.
+ */
+template <typename T, uint8_t N>
+class AdelChannel : private AdelLock
+{
+private:
+  T items[N];
+  volatile uint8_t head;
+  volatile uint8_t count;
+
+  // -- Set when a send or receive could not go ahead, so that someone may
+  //    be waiting for the next one that does
+  volatile bool waiting;
+
+  inline void changed() {
+    if (waiting) {
+      waiting = false;
+      AdelEvent::notify();
+    }
+  }
+
+public:
+  AdelChannel()
+    : head(0),
+      count(0),
+      waiting(false)
+  {}
+
+  // -- Only call these with interrupts off, such as in an interrupt
+  //    handler on a single core
+  inline bool trySend(const T & v) {
+    if (count == N) {
+      waiting = true;
+      return false;
+    }
+    // -- Sum in 16 bits, since with N over 128 it can pass 255
+    uint16_t tail = head + count;
+    if (tail >= N) tail -= N;
+    items[tail] = v;
+    count++;
+    changed();
+    return true;
+  }
+
+  inline bool tryReceive(T & v) {
+    if (count == 0) {
+      waiting = true;
+      return false;
+    }
+    v = items[head];
+    head = (head + 1 == N) ? 0 : head + 1;
+    count--;
+    changed();
+    return true;
+  }
+
+  // -- The same, from ordinary code
+  inline bool send(const T & v) {
+    lock();
+    bool ok = trySend(v);
+    unlock();
+    return ok;
+  }
+
+  inline bool receive(T & v) {
+    lock();
+    bool ok = tryReceive(v);
+    unlock();
+    return ok;
+  }
+
+  // -- Is it empty? If so, the next send wakes whoever asked (see
+  //    awaitdata).
+  inline bool waitData() {
+    lock();
+    bool none = (count == 0);
+    if (none) waiting = true;
+    unlock();
+    return none;
+  }
+
+  inline uint8_t size() const { return count; }
+  inline bool empty() const { return count == 0; }
+  inline bool full() const { return count == N; }
+};
+
+/** ADEL_BARRIER
+ *
+ *  Keeps the compiler from moving memory accesses across this point, which
+ *  is all that a single core needs between an interrupt handler and the
+ *  main program. Dual-core chips get a real memory barrier, so that an
+ *  AdelQueue can connect functions on different cores.
+ */
+#ifndef ADEL_BARRIER
+#if ADEL_CORES > 1
+#define ADEL_BARRIER()  __sync_synchronize()
+#else
+#define ADEL_BARRIER()  __asm__ __volatile__ ("" ::: "memory")
+#endif
+#endif
+
+/** AdelQueue
+ *
+ *  A queue of up to N values of type T (N a power of two, at most 128)
+ *  for exactly one producer and one consumer, typically an interrupt
+ *  handler feeding an Adel function, or a function on one core feeding one
+ *  on the other. Unlike AdelChannel, neither side ever turns interrupts
+ *  off: the producer only writes the head index and the consumer only
+ *  writes the tail, and each index is a single byte, so it is never seen
+ *  half-written.
+ *
+ *  A push onto an empty queue, or a pop from a full one, wakes the
+ *  functions waiting for an event, so a consumer blocked in areceive or
+ *  awaitdata runs again only when there is data. With more than one core,
+ *  the other side may empty (or fill) the queue and go to sleep just
+ *  after its index was read, so every push and pop wakes them:
+ *
+ *     AdelQueue<uint16_t, 64> samples;
+ *     ISR(ADC_vect) { samples.push(ADC); }
+ *     ...
+ *     while (1) {
+ *       awaitdata( samples );
+ *       while (samples.pop(s)) filter(s);
+ *     }
+ */
+template <typename T, uint8_t N>
+class AdelQueue
+{
+  static_assert((N & (N - 1)) == 0 && N <= 128,
+                "AdelQueue size must be a power of two, at most 128");
+
+private:
+  T items[N];
+
+  // -- Free-running counts of pushes and pops, modulo 256
+  volatile uint8_t head;
+  volatile uint8_t tail;
+
+public:
+  AdelQueue()
+    : head(0),
+      tail(0)
+  {}
+
+  // -- Producer side only
+  inline bool push(const T & v) {
+    uint8_t h = head;
+    uint8_t t = tail;
+    if ((uint8_t) (h - t) == N) return false;
+    items[h & (N - 1)] = v;
+    ADEL_BARRIER();
+    head = h + 1;
+    ADEL_BARRIER();
+    if (ADEL_CORES > 1 || h == t) AdelEvent::notify();
+    return true;
+  }
+
+  // -- Consumer side only
+  inline bool pop(T & v) {
+    uint8_t t = tail;
+    uint8_t h = head;
+    if (h == t) return false;
+    ADEL_BARRIER();
+    v = items[t & (N - 1)];
+    ADEL_BARRIER();
+    tail = t + 1;
+    ADEL_BARRIER();
+    if (ADEL_CORES > 1 || (uint8_t) (h - t) == N) AdelEvent::notify();
+    return true;
+  }
+
+  // -- So that asend and areceive work on queues, too
+  inline bool send(const T & v) { return push(v); }
+  inline bool receive(T & v) { return pop(v); }
+  inline bool waitData() const { return empty(); }
+
+  inline uint8_t size() const { return (uint8_t) (head - tail); }
+  inline bool empty() const { return head == tail; }
+  inline bool full() const { return (uint8_t) (head - tail) == N; }
+};
+
+/** Timing
+ *
+ *  The millis() clock wraps around after about 49.7 days, so Adel never
+ *  compares two times directly. Instead, it looks at the sign of their
+ *  difference, which gives the right answer as long as the two times are
+ *  less than about 24.8 days apart.
+ */
+inline bool adel_before(uint32_t a, uint32_t b)
+{
+  return (int32_t) (a - b) < 0;
+}
+
+/** Staged output
+ *
+ *  Functions like blink in a big aboth or aall tree each call digitalWrite
+ *  on their own, and on AVR every call looks up the port and bit for the
+ *  pin and checks for PWM. With ADEL_OUTPUT defined before including
+ *  adel.h, awrite(pin, value) writes to a shadow image of the output ports
+ *  instead, and the runtime writes each port that changed once, directly
+ *  to its register, at the end of each pass:
+ *
+ *     #define ADEL_OUTPUT 1
+ *     #include <adel.h>
+ *     ...
+ *     awrite(pin, HIGH);
+ *
+ *  Only use awrite on pins set up with pinMode(pin, OUTPUT) and not used
+ *  with analogWrite, and remember that digitalRead does not see the new
+ *  value until the end of the pass. On other chips the writes are still
+ *  batched, and several writes to the same pin in one pass only cost one
+ *  digitalWrite, but the flush goes through digitalWrite. Without
+ *  ADEL_OUTPUT, awrite is just digitalWrite.
+ */
+#ifdef ADEL_OUTPUT
+
+#if defined(__AVR__)
+
+// -- Port numbers on AVR boards go up to PL (12) on the Mega
+#ifndef ADEL_OUTPUT_PORTS
+#define ADEL_OUTPUT_PORTS 13
+#endif
+
+class AdelOutput
+{
+private:
+  // -- Bits to set and clear in each port, and which ports have any
+  struct Image {
+    uint8_t set[ADEL_OUTPUT_PORTS];
+    uint8_t clr[ADEL_OUTPUT_PORTS];
+    uint16_t dirty;
+  };
+
+  static inline Image & image() {
+    static Image im;
+    return im;
+  }
+
+public:
+  static inline void write(uint8_t pin, uint8_t val) {
+    Image & im = image();
+    uint8_t port = digitalPinToPort(pin);
+    uint8_t bit = digitalPinToBitMask(pin);
+    if (port == NOT_A_PIN || port >= ADEL_OUTPUT_PORTS) return;
+    if (val == LOW) {
+      im.clr[port] |= bit;
+      im.set[port] &= ~bit;
+    } else {
+      im.set[port] |= bit;
+      im.clr[port] &= ~bit;
+    }
+    im.dirty |= ((uint16_t) 1) << port;
+  }
+
+  static inline void flush() {
+    Image & im = image();
+    if ( ! im.dirty) return;
+    for (uint8_t port = 0; port < ADEL_OUTPUT_PORTS; port++) {
+      if (im.dirty & (((uint16_t) 1) << port)) {
+        volatile uint8_t * out = portOutputRegister(port);
+        uint8_t oldSREG = SREG;
+        cli();
+        *out = (*out & ~im.clr[port]) | im.set[port];
+        SREG = oldSREG;
+        im.set[port] = 0;
+        im.clr[port] = 0;
+      }
+    }
+    im.dirty = 0;
+  }
+};
+
+#else
+
+// -- Highest pin number that can be staged, plus one
+#ifndef ADEL_OUTPUT_PINS
+#define ADEL_OUTPUT_PINS 64
+#endif
+
+class AdelOutput
+{
+private:
+  // -- One bit per pin for the value, and for whether it was written
+  struct Image {
+    uint8_t level[(ADEL_OUTPUT_PINS + 7) / 8];
+    uint8_t dirty[(ADEL_OUTPUT_PINS + 7) / 8];
+    bool any;
+  };
+
+  // -- Each core flushes the writes made by its own functions
+  static inline Image & image() {
+    static Image im[ADEL_CORES];
+    return im[ADEL_CORE_ID()];
+  }
+
+public:
+  static inline void write(uint8_t pin, uint8_t val) {
+    if (pin >= ADEL_OUTPUT_PINS) {
+      digitalWrite(pin, val);
+      return;
+    }
+    Image & im = image();
+    uint8_t bit = 1 << (pin & 7);
+    if (val == LOW)
+      im.level[pin >> 3] &= ~bit;
+    else
+      im.level[pin >> 3] |= bit;
+    im.dirty[pin >> 3] |= bit;
+    im.any = true;
+  }
+
+  static inline void flush() {
+    Image & im = image();
+    if ( ! im.any) return;
+    for (uint8_t i = 0; i < (ADEL_OUTPUT_PINS + 7) / 8; i++) {
+      uint8_t d = im.dirty[i];
+      for (uint8_t b = 0; d; b++, d >>= 1) {
+        if (d & 1)
+          digitalWrite(i * 8 + b, (im.level[i] >> b) & 1 ? HIGH : LOW);
+      }
+      im.dirty[i] = 0;
+    }
+    im.any = false;
+  }
+};
+
+#endif
+
+#define awrite( pin, val )  AdelOutput::write(pin, val)
+#define adel_output_flush()  AdelOutput::flush()
+
+#else
+
+#define awrite( pin, val )  digitalWrite(pin, val)
+#define adel_output_flush()
+
+#endif
+
+/** Constant tables
+ *
+ *  On AVR, tables stay in flash instead of being copied into RAM.
+ */
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#define ADEL_TABLE  PROGMEM
+#define adel_table_read(t, i)  pgm_read_word(& (t)[i])
+#else
+#define ADEL_TABLE
+#define adel_table_read(t, i)  ((t)[i])
+#endif
+
+/** Runtime stack
+ *
+ * This class encapsulates a single control stack. Activation records are
+ * structured as a tree, since multiple functions can be active at the same
+ * time. Each pass over the currently active functions starts with a call
+ * to run() on the root. The top-level loop macros, such as aonce and
+ * arepeat, each create a separate instance of this class to hold their
+ * activation records.
+ */
+class AdelRuntime
+{
+public:
+
+  // -- Global pointer to the current stack (of the running core)
+  static ADEL_PER_CORE(AdelRuntime *) curStack;
+
+private:
+  friend class AdelSleepers;
+
+  // -- Root of this tree of activation records
+  AdelAR * root;
+
+  // -- Earliest time (in millis) at which any AR in this tree needs to run
+  //    again, as recorded during the last pass. A runtime with no pending
+  //    deadline is waiting on something other than time.
+  uint32_t wake;
+  bool has_wake;
+
+  // -- Set when some AR in the subtree being run is waiting for an event
+  bool has_event;
+
+  // -- Event epoch at the start of the last pass. Sleeping ARs may only be
+  //    skipped when no event has been signaled since then.
+  adel_epoch_t seen_epoch;
+  bool skipping;
+
+  // -- Earliest deadline over all runtimes since the last aidle, and the
+  //    event epoch at that time
+  static ADEL_PER_CORE(uint32_t) loop_wake;
+  static ADEL_PER_CORE(bool) loop_has_wake;
+  static ADEL_PER_CORE(adel_epoch_t) loop_epoch;
+
+  // -- The time at the start of the current pass. All of the timing macros
+  //    use this value, so every AR in a pass sees the same time.
+  static ADEL_PER_CORE(uint32_t) now_ms;
+
+  // -- The same, in micros, for the microsecond macros (audelay, for
+  //    example). Reading micros() is not free, so it is only read the
+  //    first time one of them asks during each pass.
+  static ADEL_PER_CORE(uint32_t) now_us;
+  static ADEL_PER_CORE(bool) have_us;
+
+  // -- Time allowed for each pass over a tree, in micros (see acheckpoint).
+  //    Zero means no limit.
+  static uint32_t pass_budget;
+
+#ifdef ADEL_AR_STATS
+  AdelStats stats;
+  friend void adel_ar_created(size_t size);
+  friend void adel_ar_deleted(size_t size);
+#endif
+
+public:
+  AdelRuntime()
+    : root(0),
+      wake(0),
+      has_wake(false),
+      has_event(false),
+      seen_epoch(0),
+      skipping(false)
+  {}
+
+  // -- A null root signals that the function is not running
+  inline bool not_running() const { return root == 0; }
+
+  // -- Initialize a new run
+  inline void init(AdelAR * ar) { root = ar; }
+
+  // -- Run a single pass over the tree. This function is executed many,
+  //    many times as the functions make progress.
+  inline astatus run() {
+    now_ms = clockMillis();
+    have_us = false;
+    if (pass_budget) nowMicros();
+    adel_epoch_t e = AdelEvent::current();
+    skipping = (e == seen_epoch);
+    seen_epoch = e;
+    has_wake = false;
+    has_event = false;
+    astatus s = step(root);
+    adel_output_flush();
+    return s;
+  }
+
+  // -- Run one AR, unless it went to sleep last time and nothing it was
+  //    waiting for has happened yet, in which case nothing in its subtree
+  //    can make progress. The deadlines and events recorded while it runs
+  //    determine how it sleeps next time. The AR runs through its step
+  //    function, unless its exact type is known (see afork), in which case
+  //    the lambda is called directly.
+  template<typename A>
+  inline astatus step(A * ar) {
+    if (skipping) {
+      if (ar->parked == AdelAR::AEVENT) {
+        waitevent();
+        return astatus::ACONT;
+      }
+      if (ar->parked == AdelAR::ATIMED && adel_before(now_ms, ar->notbefore)) {
+        wakeat(ar->notbefore);
+        return astatus::ACONT;
+      }
+    }
+    uint32_t outer_wake = wake;
+    bool outer_has_wake = has_wake;
+    bool outer_has_event = has_event;
+    has_wake = false;
+    has_event = false;
+    astatus s = ar->run();
+    if (s.done())
+      ar->parked = AdelAR::ARUNNABLE;
+    else if (has_wake) {
+      ar->parked = AdelAR::ATIMED;
+      ar->notbefore = wake;
+    } else if (has_event)
+      ar->parked = AdelAR::AEVENT;
+    else
+      ar->parked = AdelAR::ARUNNABLE;
+    if (outer_has_wake && ( ! has_wake || adel_before(outer_wake, wake))) {
+      wake = outer_wake;
+      has_wake = true;
+    }
+    has_event = has_event || outer_has_event;
+    return s;
+  }
+
+  // -- Reset the run, deleting all activation records. They are deleted
+  //    as the current runtime, which is where their deletion is counted.
+  inline void reset() {
+    if (root) {
+      AdelRuntime * outer = curStack;
+      curStack = this;
+      AdelAR::destroy(root);
+      curStack = outer;
+      root = 0;
+    }
+  }
+
+#ifdef ADEL_AR_STATS
+  // -- Number of ARs in this tree, and the bytes they take up, now and at
+  //    most since the start (or since clearMax)
+  inline uint16_t liveARs() const { return stats.ars; }
+  inline uint32_t liveBytes() const { return stats.bytes; }
+  inline uint16_t maxARs() const { return stats.max_ars; }
+  inline uint32_t maxBytes() const { return stats.max_bytes; }
+
+  // -- Start the high-water marks over from the current counts
+  inline void clearMax() {
+    stats.max_ars = stats.ars;
+    stats.max_bytes = stats.bytes;
+  }
+#endif
+
+  // -- Record that some AR needs to run again at time t. Called by the
+  //    timed macros (adelay, aforatmost) on the current stack.
+  inline void wakeat(uint32_t t) {
+    if ( ! has_wake || adel_before(t, wake)) {
+      wake = t;
+      has_wake = true;
+    }
+    if ( ! loop_has_wake || adel_before(t, loop_wake)) {
+      loop_wake = t;
+      loop_has_wake = true;
+    }
+  }
+
+  // -- Record that some AR needs to run again at time t in micros. The
+  //    runtime only keeps deadlines in millis, so round down, and after
+  //    that the AR is checked on every pass until the time comes.
+  inline void wakeatmicros(uint32_t t) {
+    uint32_t left = t - nowMicros();
+    if (left >= 1000)
+      wakeat(now_ms + left / 1000);
+    else
+      wakenow();
+  }
+
+  // -- Record that some AR is polling (await, for example) and needs to
+  //    run again on the very next pass.
+  inline void wakenow() { wakeat(now_ms); }
+
+  // -- Record that some AR is waiting for an AdelEvent (see awaitevent)
+  inline void waitevent() { has_event = true; }
+
+  // -- Time at the start of the current pass
+  static inline uint32_t now() { return now_ms; }
+  static inline uint32_t nowMicros() {
+    if ( ! have_us) {
+      now_us = clockMicros();
+      have_us = true;
+    }
+    return now_us;
+  }
+
+  // -- The clock that everything in Adel goes by: millis() and micros(),
+  //    moved ahead to the time restored from a snapshot, if any
+#ifdef ADEL_SNAPSHOT
+  static inline uint32_t clockMillis() { return millis() + clock_offset(); }
+  static inline uint32_t clockMicros() { return micros() + clock_offset() * 1000; }
+#else
+  static inline uint32_t clockMillis() { return millis(); }
+  static inline uint32_t clockMicros() { return micros(); }
+#endif
+
+  // -- Limit each pass to about us micros. Only functions that use
+  //    acheckpoint pay attention.
+  static inline void passBudget(uint32_t us) { pass_budget = us; }
+
+  // -- True if the current pass has used up its budget
+  static inline bool overBudget() {
+    return pass_budget && clockMicros() - nowMicros() >= pass_budget;
+  }
+
+  // -- Deadline for this runtime from its last pass
+  inline bool waiting() const { return has_wake; }
+  inline uint32_t wakeMillis() const { return wake; }
+
+  // -- Could the next pass make progress at time now? Only if the last one
+  //    left something runnable, or its deadline has come, or an event it
+  //    might be waiting for has been signaled since.
+  inline bool ready(uint32_t now) const {
+    if ( ! has_wake && ! has_event) return true;
+    if (has_wake && ! adel_before(now, wake)) return true;
+    return has_event && seen_epoch != AdelEvent::current();
+  }
+
+  // -- Earliest deadline over all runtimes that have run since the last
+  //    call to aidle (or clearWake)
+  static inline bool anyWake() { return loop_has_wake; }
+  static inline uint32_t nextWakeMillis() { return loop_wake; }
+  static inline void clearWake() {
+    loop_has_wake = false;
+    loop_epoch = AdelEvent::current();
+  }
+
+  // -- True if an event has been signaled since then
+  static inline bool anyEvent() { return loop_epoch != AdelEvent::current(); }
+
+#ifdef ADEL_SNAPSHOT
+  // -- Save the state of the root function in mem, to be restored after
+  //    the next boot, which is ms millis from now (see asave). Returns the
+  //    number of bytes used, or 0 if they do not fit, or if the root has
+  //    variables that are not plain bytes (a list of children, say).
+  inline size_t save(void * mem, size_t len, uint32_t stamp, uint32_t ms) {
+    Image h;
+    if ( ! root || len < sizeof(h)) return 0;
+    uint8_t * bytes = (uint8_t *) mem + sizeof(h);
+    AdelImage::give(bytes, len - sizeof(h));
+    if ( ! AdelAR::save(root)) return 0;
+    h.stamp = stamp;
+    h.now = now_ms + ms;
+    h.step = root->step;
+    h.size = AdelImage::copied();
+    h.check = checksum(bytes, h.size);
+    memcpy(mem, & h, sizeof(h));
+    return sizeof(h) + h.size;
+  }
+
+  // -- Start a new run with ar, the AR of a freshly called function. If
+  //    mem holds a snapshot of the same function, saved by the same build,
+  //    the function picks up where it was saved, and the clock is moved
+  //    ahead to the time it was saved for. True if it was restored.
+  inline bool restore(AdelAR * ar, const void * mem, size_t len, uint32_t stamp) {
+    init(ar);
+    Image h;
+    if (len < sizeof(h)) return false;
+    memcpy(& h, mem, sizeof(h));
+    const uint8_t * bytes = (const uint8_t *) mem + sizeof(h);
+    if (h.stamp != stamp || h.step != ar->step || h.size > len - sizeof(h) ||
+        h.check != checksum(bytes, h.size))
+      return false;
+    AdelImage::give((void *) bytes, h.size);
+    if ( ! AdelAR::load(ar)) return false;
+    clock_offset() = h.now - millis();
+    return true;
+  }
+
+private:
+  // -- What save writes ahead of the closure. The step function tells
+  //    which function it was, as long as the build is the same.
+  struct Image {
+    uint32_t stamp;
+    uint32_t now;
+    AdelAR::Step step;
+    uint16_t size;
+    uint16_t check;
+  };
+
+  // -- Fletcher's checksum, to catch memory that did not survive
+  static inline uint16_t checksum(const uint8_t * p, size_t n) {
+    uint16_t a = 0;
+    uint16_t b = 0;
+    while (n--) {
+      a = (a + *p++) % 255;
+      b = (b + a) % 255;
+    }
+    return (b << 8) | a;
+  }
+
+  // -- Millis to add to the hardware clock. A function-local static, so
+  //    that it lives in the header, where ADEL_SNAPSHOT is visible.
+  static inline uint32_t & clock_offset() {
+    static uint32_t offset;
+    return offset;
+  }
+#endif
+};
+
+#ifdef ADEL_AR_STATS
+inline void adel_ar_created(size_t size)
+{
+  AdelRuntime::curStack->stats.created(size);
+}
+
+inline void adel_ar_deleted(size_t size)
+{
+  AdelRuntime::curStack->stats.deleted(size);
+}
+#endif
+
+inline astatus AdelChildren::runchild(int i) const
+{
+  return AdelRuntime::curStack->step(child(i));
+}
+
+inline astatus AdelChildren::runall() const
+{
+  astatus result = astatus::ADONE;
+  for (AdelAR * ch = first; ch; ch = ch->sibling) {
+    if (AdelRuntime::curStack->step(ch).notdone())
+      result = astatus::ACONT;
+  }
+  return result;
+}
+
+inline int AdelChildren::runany() const
+{
+  int which = -1;
+  int i = 0;
+  for (AdelAR * ch = first; ch; ch = ch->sibling, i++) {
+    if (AdelRuntime::curStack->step(ch).done() && which < 0)
+      which = i;
+  }
+  return which;
+}
+
+/** AdelSleepers
+ *
+ *  An aall with many children, most of them asleep in adelay, would look
+ *  at every one of them on each pass where any one of them wakes up. With
+ *  at least ADEL_SLEEPERS_MIN children, aall also keeps them in a binary
+ *  min-heap, ordered by when each one can next make progress: first the
+ *  ones that are runnable, then the ones asleep until their notbefore
+ *  time, soonest first, and last the ones waiting for an event. On a pass
+ *  with no new event, only the children at the top whose time has come
+ *  are run, so waking k of n children costs O(k log n) instead of O(n).
+ *  After an event, all of them run, as before, and the heap is rebuilt.
+ *
+ *  The heap is an array of n pointers, taken when aall starts and freed
+ *  when it is done. With ADEL_AR_POOL_BYTES it comes from the pool, so it
+ *  only fits if n pointers fit in the largest slot. If there is no room
+ *  for it, aall runs the children one by one, as it does below
+ *  ADEL_SLEEPERS_MIN. Like AdelChildren, it is one of the variables
+ *  declared by abegin, and copying gives an empty one. Set
+ *  ADEL_SLEEPERS_MIN to 0 to turn it off.
+ */
+#ifndef ADEL_SLEEPERS_MIN
+#define ADEL_SLEEPERS_MIN 16
+#endif
+
+class AdelSleepers
+{
+private:
+  AdelAR ** heap;
+  uint16_t count;
+
+  // -- Number of children the heap has room for
+  uint16_t room;
+
+  // -- Number of children in the heap waiting for an event
+  uint16_t waiting;
+
+  // -- Runnable children first, then sleeping ones, then event waiters
+  static inline uint8_t rank(const AdelAR * a) {
+    return a->parked == AdelAR::ARUNNABLE ? 0 : a->parked == AdelAR::ATIMED ? 1 : 2;
+  }
+
+  // -- Does child a come before child b?
+  static inline bool before(const AdelAR * a, const AdelAR * b) {
+    uint8_t ra = rank(a);
+    uint8_t rb = rank(b);
+    if (ra != rb) return ra < rb;
+    return ra == 1 && adel_before(a->notbefore, b->notbefore);
+  }
+
+  // -- Move the child at i up, or down, to where it belongs
+  inline void up(uint16_t i) {
+    AdelAR * ch = heap[i];
+    while (i > 0) {
+      uint16_t parent = (i - 1) / 2;
+      if ( ! before(ch, heap[parent])) break;
+      heap[i] = heap[parent];
+      i = parent;
+    }
+    heap[i] = ch;
+  }
+
+  inline void down(uint16_t i) {
+    AdelAR * ch = heap[i];
+    while (true) {
+      uint16_t kid = 2 * i + 1;
+      if (kid >= count) break;
+      if (kid + 1 < count && before(heap[kid + 1], heap[kid])) kid++;
+      if ( ! before(heap[kid], ch)) break;
+      heap[i] = heap[kid];
+      i = kid;
+    }
+    heap[i] = ch;
+  }
+
+public:
+  AdelSleepers() : heap(0), count(0), room(0), waiting(0) {}
+  AdelSleepers(const AdelSleepers &) : heap(0), count(0), room(0), waiting(0) {}
+  ~AdelSleepers() { clear(); }
+
+  // -- Free the heap (the children belong to the AdelChildren list)
+  inline void clear() {
+    if (heap) {
+#ifdef ADEL_AR_POOL_BYTES
+      AdelPool::release(heap, room * sizeof(AdelAR *));
+#else
+      free(heap);
+#endif
+    }
+    heap = 0;
+    count = 0;
+    room = 0;
+    waiting = 0;
+  }
+
+  // -- Put all of the children in the heap, if there are enough of them.
+  //    They have not run yet, so they are all runnable, in any order.
+  inline void init(const AdelChildren & children, int n) {
+    clear();
+    if (ADEL_SLEEPERS_MIN == 0 || n < ADEL_SLEEPERS_MIN) return;
+    // -- Without room for the heap, runall just runs the list
+#ifdef ADEL_AR_POOL_BYTES
+    heap = (AdelAR **) AdelPool::tryAllocate(n * sizeof(AdelAR *));
+#else
+    heap = (AdelAR **) malloc(n * sizeof(AdelAR *));
+#endif
+    if ( ! heap) return;
+    room = n;
+    for (AdelAR * ch = children.first; ch; ch = ch->sibling)
+      heap[count++] = ch;
+  }
+
+  // -- Run the children once, like AdelChildren::runall, but only the
+  //    ones that can make progress. Children that are done leave the heap.
+  inline astatus runall(const AdelChildren & children);
+};
+
+inline astatus AdelSleepers::runall(const AdelChildren & children)
+{
+  if ( ! heap) return children.runall();
+  AdelRuntime * rt = AdelRuntime::curStack;
+  if ( ! rt->skipping) {
+    // -- An event may have woken any of them: run them all, and build
+    //    the heap again from the ones that are not done
+    uint16_t kept = 0;
+    waiting = 0;
+    for (uint16_t i = 0; i < count; i++) {
+      AdelAR * ch = heap[i];
+      if (rt->step(ch).notdone()) {
+        heap[kept++] = ch;
+        if (ch->parked == AdelAR::AEVENT) waiting++;
+      }
+    }
+    count = kept;
+    for (uint16_t i = count / 2; i-- > 0; ) down(i);
+  } else {
+    // -- Take the children whose time has come off the top, leaving each
+    //    one just past the end of the heap, then run them and put back
+    //    the ones that are not done. The rest do not change.
+    uint16_t end = count;
+    uint32_t now = AdelRuntime::now();
+    while (count > 0) {
+      AdelAR * ch = heap[0];
+      if (ch->parked == AdelAR::AEVENT) break;
+      if (ch->parked == AdelAR::ATIMED && adel_before(now, ch->notbefore)) break;
+      count--;
+      heap[0] = heap[count];
+      heap[count] = ch;
+      if (count > 0) down(0);
+    }
+    for (uint16_t i = count; i < end; i++) {
+      AdelAR * ch = heap[i];
+      if (rt->step(ch).notdone()) {
+        heap[count] = ch;
+        up(count++);
+        if (ch->parked == AdelAR::AEVENT) waiting++;
+      }
+    }
+    // -- The ones that did not run still count toward this AR's sleep
+    if (waiting) rt->waitevent();
+    if (count > 0) {
+      if (heap[0]->parked == AdelAR::ATIMED)
+        rt->wakeat(heap[0]->notbefore);
+      else if (heap[0]->parked == AdelAR::ARUNNABLE)
+        rt->wakenow();
+    }
+  }
+  return count > 0 ? astatus::ACONT : astatus::ADONE;
+}
+
+/** AdelFork
+ *
+ *  Slots for the children of an afork, declared above abegin with
+ *  aforkslots, so that they become part of the parent's AR. Each slot has
+ *  room for the AR of one child function, whose exact type comes from the
+ *  function's declaration (see aforkable), so afork builds the children
+ *  right there, without allocating anything, and runs them by calling
+ *  their lambdas directly.
+ *
+ *  The slots are a chain of nested templates: each has one child, and the
+ *  rest of the slots in the rest member. Like AdelChildren, copying gives
+ *  empty slots, and destroying them stops and destroys the children.
+ */
+
+// -- The AR type of a child function, from a pointer to it (only in
+//    decltype, so these are never defined). Plain adel functions give
+//    void, which AdelFork rejects.
+template<typename T, typename... A>
+LocalAdelAR<T> adel_fork_ar(LocalAdelAR<T> * (*)(A...));
+
+template<typename F>
+void adel_fork_ar(F);
+
+template<typename C>
+struct adel_fork_void { enum { value = 0 }; };
+
+template<>
+struct adel_fork_void<void> { enum { value = 1 }; };
+
+template<typename... Fs>
+class AdelFork;
+
+template<>
+class AdelFork<>
+{
+public:
+  inline astatus runall() { return astatus::ADONE; }
+  inline void clear() {}
+};
+
+template<typename Child, typename... Fs>
+class AdelFork<Child, Fs...>
+{
+  static_assert( ! adel_fork_void<Child>::value,
+                "afork needs functions declared with aforkable, not adel");
+
+private:
+  alignas(Child) uint8_t mem[sizeof(Child)];
+  Child * ar;
+
+public:
+  AdelFork<Fs...> rest;
+
+  AdelFork() : ar(0) {}
+  AdelFork(const AdelFork &) : ar(0) {}
+  ~AdelFork() { clear(); }
+
+  // -- Offer this slot to the child function about to be called, and
+  //    then keep the AR it returns (built in the slot, normally)
+  inline void offer() { AdelPlace::give(mem, sizeof(Child)); }
+  inline void start(Child * child) {
+    AdelPlace::give(0, 0);
+    ar = child;
+  }
+
+  // -- Run every child once. Returns ADONE only when all of them are done.
+  inline astatus runall() {
+    bool done = ! ar || AdelRuntime::curStack->step(ar).done();
+    return rest.runall().done() && done ? astatus::ADONE : astatus::ACONT;
+  }
+
+  // -- Stop and destroy every child
+  inline void clear() {
+    if (ar) {
+      AdelAR::stop(ar);
+      AdelAR::destroy(ar);
+      ar = 0;
+    }
+    rest.clear();
+  }
+};
+
+/** Profiling
+ *
+ *  Defining ADEL_PROFILE before including adel.h collects statistics for
+ *  each Adel function, by name: how many times it ran, the total and
+ *  longest time (in micros) spent in each run, including the functions
+ *  it calls, and how late its adelays woke up compared with their
+ *  deadlines (in millis). Nothing is printed or allocated while the
+ *  functions run; call AdelProfile::dump(Serial) whenever you want to see
+ *  the numbers. ADEL_PROFILE_SLOTS sets how many functions are tracked.
+ */
+#ifdef ADEL_PROFILE
+
+#ifndef ADEL_PROFILE_SLOTS
+#define ADEL_PROFILE_SLOTS 16
+#endif
+
+class AdelProfile
+{
+public:
+  const char * name;
+  uint32_t runs;
+  uint32_t total_us;
+  uint32_t max_us;
+  uint32_t wakes;
+  uint32_t total_late;
+  uint32_t max_late;
+
+  // -- The table of functions seen so far
+  static inline AdelProfile * table() {
+    static AdelProfile t[ADEL_PROFILE_SLOTS];
+    return t;
+  }
+
+  // -- Slot for the function with the given name, or null if the table is
+  //    full. Called once per function (see abegin).
+  static inline AdelProfile * find(const char * name) {
+    AdelProfile * t = table();
+    for (uint8_t i = 0; i < ADEL_PROFILE_SLOTS; i++) {
+      if (t[i].name == 0) t[i].name = name;
+      if (t[i].name == name || strcmp(t[i].name, name) == 0) return & t[i];
+    }
+    return 0;
+  }
+
+  inline void ran(uint32_t us) {
+    runs++;
+    total_us += us;
+    if (us > max_us) max_us = us;
+  }
+
+  inline void woke(uint32_t late) {
+    wakes++;
+    total_late += late;
+    if (late > max_late) max_late = late;
+  }
+
+  // -- Print one line per function:
+  //      name runs total_us max_us wakes total_late max_late
+  static void dump(Print & out) {
+    AdelProfile * t = table();
+    for (uint8_t i = 0; i < ADEL_PROFILE_SLOTS && t[i].name; i++) {
+      out.print(t[i].name);
+      out.print(' ');
+      out.print(t[i].runs);
+      out.print(' ');
+      out.print(t[i].total_us);
+      out.print(' ');
+      out.print(t[i].max_us);
+      out.print(' ');
+      out.print(t[i].wakes);
+      out.print(' ');
+      out.print(t[i].total_late);
+      out.print(' ');
+      out.println(t[i].max_late);
+    }
+  }
+
+  // -- Start over, keeping the function names
+  static void reset() {
+    AdelProfile * t = table();
+    for (uint8_t i = 0; i < ADEL_PROFILE_SLOTS; i++) {
+      const char * name = t[i].name;
+      memset(& t[i], 0, sizeof(AdelProfile));
+      t[i].name = name;
+    }
+  }
+};
+
+// -- Times one run of a lambda, from its start until it returns
+class AdelProfileScope
+{
+private:
+  AdelProfile * prof;
+  uint32_t start;
+
+public:
+  AdelProfileScope(AdelProfile * p)
+    : prof(p),
+      start(micros())
+  {}
+
+  ~AdelProfileScope() {
+    if (prof) prof->ran(micros() - start);
+  }
+};
+
+#endif
+
+/** Tracing
+ *
+ *  ADEL_DEBUG prints a line for every Adel construct as it starts, which
+ *  takes so long that it changes the behavior being debugged. Defining
+ *  ADEL_TRACE instead records each of those events as a small binary
+ *  record in a ring buffer in RAM, which is cheap. Each record holds the
+ *  time (in micros), the line number, the function (as a small number),
+ *  and which construct it was (see the list below).
+ *
+ *  The records are written out in the background by the atraceflush Adel
+ *  function, which sends a few of them at a time to any Print (Serial,
+ *  for example) as raw bytes:
+ *
+ *     arepeat( atraceflush(Serial, 10) );
+ *
+ *  AdelTrace::names prints the function numbers and names, for decoding.
+ *  When the buffer is full, new records are dropped and counted.
+ *  ADEL_TRACE_RECORDS sets the size of the buffer.
+ */
+#ifdef ADEL_TRACE
+
+#ifndef ADEL_TRACE_RECORDS
+#define ADEL_TRACE_RECORDS 32
+#endif
+
+#ifndef ADEL_TRACE_FUNCS
+#define ADEL_TRACE_FUNCS 16
+#endif
+
+#ifndef ADEL_TRACE_BURST
+#define ADEL_TRACE_BURST 4
+#endif
+
+class AdelTrace
+{
+public:
+  // -- Event types, one for each construct
+  enum { E_abegin, E_aend, E_adelay, E_audelay, E_andthen, E_await,
+         E_awaitevent, E_aforatmost, E_auforatmost, E_aboth, E_athree,
+         E_aall, E_aany, E_auntil, E_aramp, E_alternate, E_ayourturn,
+         E_afinish, E_ayieldif, E_asend, E_areceive,
+         E_awaitdata, E_aonstop, E_afork };
+
+  // -- Function number that is never recorded
+  enum { UNTRACED = 0xFF };
+
+  struct Record {
+    uint32_t time;
+    uint16_t line;
+    uint8_t fun;
+    uint8_t event;
+  };
+
+private:
+  struct Buffer {
+    Record records[ADEL_TRACE_RECORDS];
+    uint16_t head;
+    uint16_t count;
+    uint16_t dropped;
+    const char * names[ADEL_TRACE_FUNCS];
+  };
+
+  static inline Buffer & buffer() {
+    static Buffer b;
+    return b;
+  }
+
+public:
+  // -- Number for the function with the given name. Called once per
+  //    function (see abegin). Functions past the end of the table all get
+  //    the last number.
+  static inline uint8_t id(const char * name) {
+    Buffer & b = buffer();
+    uint8_t i;
+    for (i = 0; i < ADEL_TRACE_FUNCS - 1; i++) {
+      if (b.names[i] == 0) b.names[i] = name;
+      if (b.names[i] == name || strcmp(b.names[i], name) == 0) break;
+    }
+    return i;
+  }
+
+  static inline void record(uint8_t fun, uint16_t line, uint8_t event) {
+    Buffer & b = buffer();
+    if (fun == UNTRACED) return;
+    if (b.count == ADEL_TRACE_RECORDS) {
+      b.dropped++;
+      return;
+    }
+    uint16_t i = b.head + b.count;
+    if (i >= ADEL_TRACE_RECORDS) i -= ADEL_TRACE_RECORDS;
+    Record & r = b.records[i];
+    r.time = micros();
+    r.line = line;
+    r.fun = fun;
+    r.event = event;
+    b.count++;
+  }
+
+  // -- Write up to max records to out, oldest first. Returns how many.
+  static inline uint16_t drain(Print & out, uint16_t max) {
+    Buffer & b = buffer();
+    uint16_t n = 0;
+    while (b.count > 0 && n < max) {
+      out.write((const uint8_t *) & b.records[b.head], sizeof(Record));
+      b.head++;
+      if (b.head == ADEL_TRACE_RECORDS) b.head = 0;
+      b.count--;
+      n++;
+    }
+    return n;
+  }
+
+  static inline uint16_t pending() { return buffer().count; }
+  static inline uint16_t dropped() { return buffer().dropped; }
+
+  // -- Print one line per function: number name
+  static void names(Print & out) {
+    Buffer & b = buffer();
+    for (uint8_t i = 0; i < ADEL_TRACE_FUNCS && b.names[i]; i++) {
+      out.print(i);
+      out.print(' ');
+      out.println(b.names[i]);
+    }
+  }
+};
+
+#endif
+
+// ------------------------------------------------------------
+//   Internal macros
+
+#if defined(ADEL_TRACE)
+#define adel_debug(m, line)						\
+  AdelTrace::record(a_trace_id, line, AdelTrace::E_##m);
+#elif defined(ADEL_DEBUG)
+#define adel_debug(m, line)			\
+  Serial.print(#m);							\
+  Serial.print(" in ");				\
+  Serial.print(a_fun_name);			\
+  Serial.print(":");				\
+  Serial.println(line)
+#else
+#define adel_debug(m, line)  ;
+#endif
+
+// -- The function's name is only kept when something will print it. It is
+//    static, so it is never captured by the lambda.
+#if defined(ADEL_DEBUG) || defined(ADEL_TRACE) || defined(ADEL_PROFILE)
+#define adel_fun_name							\
+  static const char * const a_fun_name = __FUNCTION__;
+#else
+#define adel_fun_name
+#endif
+
+#ifdef ADEL_TRACE
+#define adel_trace_find							\
+  static uint8_t a_trace_id = AdelTrace::id(a_fun_name);
+#else
+#define adel_trace_find
+#endif
+
+#ifdef ADEL_PROFILE
+#define adel_profile_find						\
+  static AdelProfile * a_prof = AdelProfile::find(a_fun_name);
+#define adel_profile_run  AdelProfileScope a_prof_scope(a_prof);
+#define adel_profile_wake(t)						\
+  if (a_prof) a_prof->woke(AdelRuntime::now() - (t));
+#else
+#define adel_profile_find
+#define adel_profile_run
+#define adel_profile_wake(t)
+#endif
+
+/** gensym
+ *
+ *  These macros allow us to construct identifier names using line
+ *  numbers. For some reason g++ requires two levels of macros to get it to
+ *  work as expected.
+ */
+#define agensym2(a,b) a##b
+#define agensym(a,b) agensym2(a,b)
+
+/** adel_here
+ *
+ *  This macro encapsulates the representation of a program counter in
+ *  Adel. Each construct is a thin wrapper that passes adel_here to the
+ *  macro that does the work, as its pc argument. Macro arguments are
+ *  expanded only once, so every use of pc in that macro is the same step
+ *  number, and constructs that need more than one case use pc + 1 and
+ *  pc + 2, which adel_here3 reserves.
+ *
+ *  The steps come from __COUNTER__, counted from the base that abegin
+ *  records, so they are small and consecutive within each function no
+ *  matter how long the file is. The switch in each function can then be a
+ *  jump table, and the PC fits in a byte.
+ */
+#define adel_step(c)  ((c) - adel_pc_base + 2)
+
+#ifndef ADEL_LINE_PCS
+#define adel_here  adel_step(__COUNTER__)
+#define adel_here3  adel_step(__COUNTER__ + 0 * __COUNTER__ * __COUNTER__)
+#else
+// -- The old numbering, ten steps per source line, only for comparison
+//    (see the resume workload in bench). The case values are far apart,
+//    so the compiler searches for them instead of using a jump table, and
+//    there can only be one construct per line.
+#define adel_here  (__LINE__ * 10)
+#define adel_here3  (__LINE__ * 10)
+#endif
+
+// ------------------------------------------------------------
+//   Top-level functions for use in Arduino loop()
+//
+//   You can put as many of these as you'd like in your loop function
+
+/** aforever
+ *
+ *  Run the given Adel function over and over.
+ */
+#define arepeat( f )							\
+  static AdelRuntime agensym(aruntime, __LINE__);			\
+  AdelRuntime::curStack = & agensym(aruntime, __LINE__);		\
+  if ( AdelRuntime::curStack->not_running())				\
+    AdelRuntime::curStack->init( f );					\
+  astatus agensym(f_status, __LINE__) = AdelRuntime::curStack->run();	\
+  if (agensym(f_status, __LINE__).done()) {				\
+    AdelRuntime::curStack->reset();					\
+    AdelRuntime::curStack->wakenow();					\
+  }
+
+#ifdef ADEL_SNAPSHOT
+/** aresume and asave
+ *
+ *  Pick up after a reset (waking from deep sleep, say) where a function
+ *  left off, instead of starting it over. aresume is just like arepeat,
+ *  except that the first time it starts f, it restores the snapshot that
+ *  asave left in mem, if there is one of the same function from the same
+ *  build. asave saves the function run by the last aresume (or arepeat)
+ *  and returns the number of bytes used, or 0 if it could not save it:
+ *
+ *     RTC_DATA_ATTR uint8_t saved[64];
+ *     ...
+ *     aresume( logger(), saved );
+ *     if (asave( saved, 60000 )) esp_deep_sleep(60000000);
+ *
+ *  The second argument to asave is how long until the function resumes,
+ *  which counts toward any adelay it is in. Only functions whose
+ *  variables are all plain bytes can be saved, so not ones that call
+ *  other Adel functions (with aboth or andthen, for example). Pointers in
+ *  them must point to things at fixed addresses, such as globals.
+ */
+#ifndef ADEL_SNAPSHOT_STAMP
+#define ADEL_SNAPSHOT_STAMP adel_stamp(__DATE__ " " __TIME__)
+#endif
+
+// -- Hash of a string (FNV-1a), to tell one build from another
+inline uint32_t adel_stamp(const char * s)
+{
+  uint32_t h = 2166136261u;
+  while (*s) h = (h ^ (uint8_t) *s++) * 16777619u;
+  return h;
+}
+
+#define aresume( f, mem )						\
+  static AdelRuntime agensym(aruntime, __LINE__);			\
+  static bool agensym(aresumed, __LINE__) = false;			\
+  AdelRuntime::curStack = & agensym(aruntime, __LINE__);		\
+  if ( AdelRuntime::curStack->not_running()) {				\
+    if (agensym(aresumed, __LINE__))					\
+      AdelRuntime::curStack->init( f );					\
+    else								\
+      AdelRuntime::curStack->restore( f, mem, sizeof(mem),		\
+                                      ADEL_SNAPSHOT_STAMP );		\
+    agensym(aresumed, __LINE__) = true;					\
+  }									\
+  astatus agensym(f_status, __LINE__) = AdelRuntime::curStack->run();	\
+  if (agensym(f_status, __LINE__).done()) {				\
+    AdelRuntime::curStack->reset();					\
+    AdelRuntime::curStack->wakenow();					\
+  }
+
+#define asave( mem, ms )						\
+  AdelRuntime::curStack->save(mem, sizeof(mem), ADEL_SNAPSHOT_STAMP, ms)
+#endif
+
+/** AdelPeriod
+ *
+ *  Schedule for a function that runs periodically (see aevery). The
+ *  function is started at the beginning of each period, but only once the
+ *  previous run is done, so a run that takes longer than the period makes
+ *  the next one late. The policy says what to do when that happens:
+ *
+ *    ACATCHUP : stay on schedule by starting the missed runs back to back
+ *               (this is what aevery does)
+ *    ASKIP    : drop the late run and any missed ones, and wait for the
+ *               next period boundary that has not passed yet
+ *    AASAP    : start one run right away and restart the schedule from now
+ *
+ *  The schedule also counts how many periods were missed and remembers the
+ *  worst lateness, in the same units as the period, so you can check your
+ *  timing on real hardware. A run that should have started at next but
+ *  could only start at now missed (now - next) / period whole periods,
+ *  whatever the policy; the runs ACATCHUP starts to make up for them are
+ *  not counted again.
+ *
+ *     AdelPeriod display(100, AdelPeriod::ASKIP);
+ *     void loop()
+ *     {
+ *       aperiodic( display, updatedisplay() );
+ *       if (display.missed() > 0) ...
+ *     }
+ */
+class AdelPeriod
+{
+public:
+  enum { ACATCHUP, ASKIP, AASAP };
+
+private:
+  uint32_t next;
+  uint32_t period;
+  uint8_t policy;
+  bool started;
+  uint32_t nmissed;
+  uint32_t worst;
+
+  // -- The first period boundary not yet counted as missed, so that the
+  //    runs ACATCHUP starts back to back do not count it again
+  uint32_t counted;
+
+  // -- Did the last run finish before its period boundary?
+  bool waited;
+
+public:
+  AdelPeriod(uint32_t T, uint8_t p = ACATCHUP)
+    : next(0),
+      period(T),
+      policy(p),
+      started(false),
+      nmissed(0),
+      worst(0),
+      counted(0),
+      waited(false)
+  {}
+
+  // -- The first run starts right away, and the schedule starts with it
+  inline bool running() const { return started; }
+  inline void start(uint32_t now) {
+    next = now + period;
+    counted = next;
+    started = true;
+  }
+
+  // -- Called on each pass where the last run is done: if it is time for
+  //    the next run, update the schedule according to the policy and say
+  //    whether to start it now, or wait until nextTime()
+  inline bool release(uint32_t now) {
+    if (adel_before(now, next)) {
+      waited = true;
+      return false;
+    }
+    uint32_t late = now - next;
+    uint32_t behind = late / period;
+    if (late > worst) worst = late;
+    if ( ! adel_before(next, counted)) {
+      nmissed += behind;
+      counted = next + (behind + 1) * period;
+    }
+    // -- ASKIP only starts a run on time: right at the boundary, after
+    //    the last run finished and waited for it
+    bool on_time = waited && behind == 0;
+    waited = false;
+    if (policy == ASKIP) {
+      next += period * (behind + 1);
+      return on_time;
+    }
+    if (policy == AASAP)
+      next = now + period;
+    else
+      next += period;
+    return true;
+  }
+
+  inline uint32_t nextTime() const { return next; }
+
+  // -- Statistics
+  inline uint32_t missed() const { return nmissed; }
+  inline uint32_t worstLateness() const { return worst; }
+  inline void resetStats() {
+    nmissed = 0;
+    worst = 0;
+  }
+};
+
+/** adel_periodic
+ *
+ *  Common code for the periodic top-level functions: now is the time
+ *  source and wake is the runtime method that records a deadline on the
+ *  same clock.
+ */
+#define adel_periodic( p, f, now, wake )				\
+  static AdelRuntime agensym(aruntime, __LINE__);			\
+  AdelRuntime::curStack = & agensym(aruntime, __LINE__);		\
+  if ( AdelRuntime::curStack->not_running())				\
+    AdelRuntime::curStack->init( f );					\
+  astatus agensym(f_status, __LINE__) = AdelRuntime::curStack->run();	\
+  if ( ! p.running()) p.start(now);					\
+  if (agensym(f_status, __LINE__).done()) {				\
+    if (p.release(now)) {						\
+      AdelRuntime::curStack->reset();					\
+      AdelRuntime::curStack->wakenow();					\
+    } else								\
+      AdelRuntime::curStack->wake(p.nextTime());			\
+  }
+
+/** aperiodic
+ *
+ *  Run the given Adel function on the schedule p, which is an AdelPeriod
+ *  in milliseconds. auperiodic is the same, with p in microseconds.
+ */
+#define aperiodic( p, f )						\
+  adel_periodic( p, f, AdelRuntime::now(), wakeat )
+
+#define auperiodic( p, f )						\
+  adel_periodic( p, f, AdelRuntime::nowMicros(), wakeatmicros )
+
+/** aevery
+ *  
+ *  Run the given Adel function every T milliseconds.
+ */
+#define aevery( T, f )							\
+  static AdelPeriod agensym(aperiod, __LINE__)(T);			\
+  aperiodic( agensym(aperiod, __LINE__), f )
+
+/** auevery
+ *
+ *  Run the given Adel function every T microseconds.
+ */
+#define auevery( T, f )							\
+  static AdelPeriod agensym(aperiod, __LINE__)(T);			\
+  auperiodic( agensym(aperiod, __LINE__), f )
+
+/** aonce
+ *
+ *  Run an adel function from the top one time. Once complete, the program
+ *  stops running and nothing will happen on the microcontroller until it
+ *  is restarted. Probably not what you want!
+ */
+#define aonce( f )							\
+  static AdelRuntime agensym(aruntime, __LINE__);			\
+  AdelRuntime::curStack = & agensym(aruntime, __LINE__);		\
+  if (AdelRuntime::curStack->not_running())				\
+     AdelRuntime::curStack->init( f );					\
+  AdelRuntime::curStack->run();
+
+/** AdelTask
+ *
+ *  A top-level runtime with a priority, run by an AdelScheduler (see
+ *  aschedule). Higher numbers are more urgent.
+ */
+class AdelTask
+{
+  friend class AdelScheduler;
+
+private:
+  AdelRuntime rt;
+  uint8_t prio;
+
+  // -- Set when the last loop ran out of time before this task's turn
+  bool deferred;
+  uint32_t ndeferred;
+
+  // -- Next task in the scheduler, in priority order
+  AdelTask * next;
+  bool added;
+
+  // -- Time at the start of the task's last pass
+  uint32_t ran;
+
+public:
+  AdelTask(uint8_t p)
+    : prio(p),
+      deferred(false),
+      ndeferred(0),
+      next(0),
+      added(false),
+      ran(0)
+  {}
+
+  inline AdelRuntime & runtime() { return rt; }
+  inline uint8_t priority() const { return prio; }
+  inline bool scheduled() const { return added; }
+
+  // -- Is the deadline from its last pass already here? A task that was
+  //    polling (await, for example) asked for the very next pass, not for
+  //    a deadline, so it does not count: it only ever gets its one pass.
+  inline bool due() const {
+    return ! rt.not_running() && rt.waiting() &&
+      adel_before(ran, rt.wakeMillis()) &&
+      ! adel_before(AdelRuntime::clockMillis(), rt.wakeMillis());
+  }
+
+  // -- Number of loops in which the task lost its turn to the budget
+  inline uint32_t deferrals() const { return ndeferred; }
+};
+
+/** AdelScheduler
+ *
+ *  Runs a set of top-level functions by priority, instead of one pass
+ *  each in the order they appear in loop(). Each call to run() works
+ *  through the tasks from the most urgent to the least, and before each
+ *  task gives another pass to any more urgent one whose deadline has come
+ *  around again. Whatever time is left in the budget (in micros) goes to
+ *  extra passes for tasks that are due, again most urgent first.
+ *
+ *  Once the budget is spent, the remaining tasks lose their turn, but a
+ *  task that lost its turn in the last loop always gets one, so every
+ *  task runs at least every other loop. The most urgent task runs in
+ *  every loop.
+ *
+ *     AdelScheduler sched;
+ *     void loop()
+ *     {
+ *       aschedule( sched, 2, motorcontrol() );
+ *       aschedule( sched, 1, updatedisplay() );
+ *       sched.run(2000);
+ *     }
+ */
+class AdelScheduler
+{
+private:
+  AdelTask * tasks;
+  uint32_t start_us;
+  uint32_t budget_us;
+
+  inline bool spent() const { return micros() - start_us >= budget_us; }
+
+  // -- One pass over a task, restarting it (on the next aschedule) when done
+  inline void pass(AdelTask * t) {
+    AdelRuntime::curStack = & t->rt;
+    astatus s = t->rt.run();
+    t->ran = AdelRuntime::now();
+    if (s.done()) {
+      t->rt.reset();
+      t->rt.wakenow();
+    }
+  }
+
+  // -- Extra passes for due tasks more urgent than upto (or for all tasks,
+  //    if upto is null), until none is due or the budget is spent
+  inline void hurry(AdelTask * upto) {
+    AdelTask * t = tasks;
+    while (t && t != upto && ( ! upto || t->prio > upto->prio) && ! spent()) {
+      if (t->due()) {
+        pass(t);
+        t = tasks;
+      } else
+        t = t->next;
+    }
+  }
+
+public:
+  AdelScheduler()
+    : tasks(0),
+      start_us(0),
+      budget_us(0)
+  {}
+
+  // -- Add a task, after any others of the same priority
+  inline void add(AdelTask * task) {
+    AdelTask ** p = & tasks;
+    while (*p && (*p)->prio >= task->prio)
+      p = & (*p)->next;
+    task->next = *p;
+    *p = task;
+    task->added = true;
+  }
+
+  // -- One loop over the tasks, within a budget of about budget micros
+  inline void run(uint32_t budget) {
+    start_us = micros();
+    budget_us = budget;
+    for (AdelTask * t = tasks; t; t = t->next) {
+      if (t->rt.not_running())
+        continue;
+      if (t != tasks && ! t->deferred && spent()) {
+        t->deferred = true;
+        t->ndeferred++;
+        continue;
+      }
+      hurry(t);
+      pass(t);
+      t->deferred = false;
+    }
+    hurry(0);
+  }
+};
+
+/** aschedule
+ *
+ *  Run the given Adel function over and over, like arepeat, but as a task
+ *  of the scheduler s with priority prio. The function runs when s.run()
+ *  is called, not where aschedule appears.
+ */
+#define aschedule( s, prio, f )						\
+  static AdelTask agensym(atask, __LINE__)(prio);			\
+  if ( ! agensym(atask, __LINE__).scheduled())				\
+    (s).add(& agensym(atask, __LINE__));				\
+  if (agensym(atask, __LINE__).runtime().not_running()) {		\
+    AdelRuntime::curStack = & agensym(atask, __LINE__).runtime();	\
+    agensym(atask, __LINE__).runtime().init( f );			\
+  }
+
+/** AdelExecutor
+ *
+ *  Runs many top-level runtimes on a pool of ADEL_WORKERS threads, for
+ *  hosts (a simulator running thousands of virtual devices, say) and for
+ *  ESP32, where FreeRTOS provides the threads. Each worker has a queue of
+ *  runtimes. It gives a pass to each one that is ready (see
+ *  AdelRuntime::ready), and when none of its own are, it steals a ready
+ *  one from the back of another worker's queue. A worker with nothing to
+ *  do sleeps until the earliest deadline it has seen, or until an event is
+ *  signaled or something is sent on a channel.
+ *
+ *     AdelExecutor ex;
+ *     AdelRuntime devices[1000];
+ *     ...
+ *     for (int i = 0; i < 1000; i++)
+ *       aspawn( ex, devices[i], device(i) );
+ *     ex.run();
+ *
+ *  A runtime only ever runs on one worker at a time, and the macros and
+ *  the AR tree are the same as always, so Adel functions do not need to
+ *  change. Functions in different runtimes should only share data through
+ *  channels and queues. run() returns when every runtime is done.
+ */
+#ifdef ADEL_WORKERS
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+
+// -- Longest that an idle worker sleeps before looking for work again
+#ifndef ADEL_WORKER_PARK_MS
+#define ADEL_WORKER_PARK_MS 10
+#endif
+
+class AdelExecutor
+{
+private:
+  struct Queue {
+    std::mutex m;
+    std::deque<AdelRuntime *> q;
+  };
+
+  Queue queues[ADEL_WORKERS];
+  uint16_t next_queue;
+
+  // -- Number of runtimes that are not done yet
+  std::atomic<unsigned> live;
+
+  // -- Idle workers, of all executors, wait here (see adel_workers_wake)
+  static std::mutex park_lock;
+  static std::condition_variable park_cv;
+
+  // -- Take a ready runtime from the front of queue w, putting the ones
+  //    that are not ready at the back. Keeps track of the earliest
+  //    deadline among those.
+  inline AdelRuntime * take(uint8_t w, uint32_t now,
+                            uint32_t & wake, bool & has_wake) {
+    Queue & qu = queues[w];
+    std::lock_guard<std::mutex> g(qu.m);
+    for (size_t n = qu.q.size(); n > 0; n--) {
+      AdelRuntime * rt = qu.q.front();
+      qu.q.pop_front();
+      if (rt->ready(now)) return rt;
+      qu.q.push_back(rt);
+      note_wake(rt, wake, has_wake);
+    }
+    return 0;
+  }
+
+  // -- Steal a ready runtime from the back of queue w
+  inline AdelRuntime * steal(uint8_t w, uint32_t now,
+                             uint32_t & wake, bool & has_wake) {
+    Queue & qu = queues[w];
+    std::lock_guard<std::mutex> g(qu.m);
+    for (size_t i = qu.q.size(); i > 0; i--) {
+      AdelRuntime * rt = qu.q[i - 1];
+      if (rt->ready(now)) {
+        qu.q.erase(qu.q.begin() + (i - 1));
+        return rt;
+      }
+      note_wake(rt, wake, has_wake);
+    }
+    return 0;
+  }
+
+  static inline void note_wake(AdelRuntime * rt,
+                               uint32_t & wake, bool & has_wake) {
+    if (rt->waiting() && ( ! has_wake || adel_before(rt->wakeMillis(), wake))) {
+      wake = rt->wakeMillis();
+      has_wake = true;
+    }
+  }
+
+  inline void push(uint8_t w, AdelRuntime * rt) {
+    std::lock_guard<std::mutex> g(queues[w].m);
+    queues[w].q.push_back(rt);
+  }
+
+  // -- Sleep until about time wake, or until something happens
+  inline void park(uint32_t now, uint32_t wake, bool has_wake, adel_epoch_t epoch) {
+    uint32_t ms = ADEL_WORKER_PARK_MS;
+    if (has_wake) {
+      if ( ! adel_before(now, wake)) return;
+      if (wake - now < ms) ms = wake - now;
+    }
+    std::unique_lock<std::mutex> lk(park_lock);
+    park_cv.wait_for(lk, std::chrono::milliseconds(ms), [&] {
+      return AdelEvent::current() != epoch || live == 0;
+    });
+  }
+
+  // -- The loop of worker w
+  inline void work(uint8_t w) {
+    adel_worker_id = w + 1;
+    while (live > 0) {
+      adel_epoch_t epoch = AdelEvent::current();
+      uint32_t now = AdelRuntime::clockMillis();
+      uint32_t wake = 0;
+      bool has_wake = false;
+      AdelRuntime * rt = take(w, now, wake, has_wake);
+      for (uint8_t i = 1; ! rt && i < ADEL_WORKERS; i++)
+        rt = steal((w + i) % ADEL_WORKERS, now, wake, has_wake);
+      if ( ! rt) {
+        park(now, wake, has_wake, epoch);
+        continue;
+      }
+      AdelRuntime::curStack = rt;
+      if (rt->run().done()) {
+        rt->reset();
+        live--;
+        wakeAll();
+      } else
+        push(w, rt);
+    }
+  }
 
 public:
-  AdelRuntime()
-    : root(0)
+  AdelExecutor()
+    : next_queue(0),
+      live(0)
   {}
 
-  // -- A null root signals that the function is not running
-  inline bool not_running() const { return root == 0; }
-
-  // -- Initialize a new run
-  inline void init(AdelAR * ar) { root = ar; }
+  // -- Add a runtime that has been given its root (see aspawn). Runtimes
+  //    are dealt out to the workers in turn.
+  inline void add(AdelRuntime * rt) {
+    live++;
+    push(next_queue, rt);
+    next_queue = (next_queue + 1) % ADEL_WORKERS;
+  }
 
-  // -- Run a single pass over the tree. This function is executed many,
-  //    many times as the functions make progress.
-  inline astatus run() { return root->run(); }
+  // -- Run everything until it is all done
+  inline void run() {
+    std::thread threads[ADEL_WORKERS];
+    for (uint8_t w = 0; w < ADEL_WORKERS; w++)
+      threads[w] = std::thread(& AdelExecutor::work, this, w);
+    for (uint8_t w = 0; w < ADEL_WORKERS; w++)
+      threads[w].join();
+  }
 
-  // -- Reset the run, deleting all activation records
-  inline void reset() {
-    if (root) {
-      delete root;
-      root = 0;
-    }
+  // -- Wake the idle workers
+  static inline void wakeAll() {
+    { std::lock_guard<std::mutex> g(park_lock); }
+    park_cv.notify_all();
   }
 };
 
-// ------------------------------------------------------------
-//   Internal macros
-
-#ifdef ADEL_DEBUG
-#define adel_debug(m, line)			\
-  Serial.print(m);				\
-  Serial.print(" in ");				\
-  Serial.print(a_fun_name);			\
-  Serial.print(":");				\
-  Serial.println(line)
-#else
-#define adel_debug(m, line)  ;
-#endif
+inline void adel_workers_wake()
+{
+  AdelExecutor::wakeAll();
+}
 
-/** gensym
+/** aspawn
  *
- *  These macros allow us to construct identifier names using line
- *  numbers. For some reason g++ requires two levels of macros to get it to
- *  work as expected.
+ *  Start the Adel function f in runtime rt, as a task of executor ex. It
+ *  runs once, when ex.run() is called, and rt must outlive it.
  */
-#define agensym2(a,b) a##b
-#define agensym(a,b) agensym2(a,b)
+#define aspawn( ex, rt, f )						\
+  AdelRuntime::curStack = & (rt);					\
+  (rt).init( f );							\
+  (ex).add(& (rt));
 
-/** anextstep
- * 
- *  This macro encapsulates the representation of a program counter in
- *  Adel. Based on the __LINE__ directive. Multiplying by 10 gives us room
- *  to have several cases within a single macro by adding an offset.
- */
+#endif
 
-#define anextstep (__LINE__*10)
-#define alaterstep(offset) (__LINE__*10 + offset)
+/** aidle
+ *
+ *  Put the processor to sleep until the earliest deadline recorded by the
+ *  top-level functions above it, or until an interrupt arrives. Call it
+ *  last in loop():
+ *
+ *     void loop()
+ *     {
+ *       arepeat( mylightshow() );
+ *       aidle();
+ *     }
+ *
+ *  On AVR this uses idle sleep mode, which leaves the timer that drives
+ *  millis() running; on ARM it uses WFI (WFE on a dual-core RP2040, so
+ *  that the other core can wake it), and on ESP32 it gives the CPU to
+ *  FreeRTOS for one tick. Define ADEL_CPU_SLEEP before including adel.h
+ *  to use something else. With no way to sleep, aidle just waits without
+ *  re-running the Adel functions. Signaling an AdelEvent from an
+ *  interrupt handler ends the sleep early.
+ */
+#ifndef ADEL_CPU_SLEEP
+#if defined(__AVR__)
+#include <avr/sleep.h>
+#define ADEL_CPU_SLEEP()  { set_sleep_mode(SLEEP_MODE_IDLE); sleep_mode(); }
+#elif ADEL_CORES > 1 && defined(ARDUINO_ARCH_RP2040)
+#define ADEL_CPU_SLEEP()  __asm__ volatile ("wfe")
+#elif defined(ARDUINO_ARCH_ESP32)
+#define ADEL_CPU_SLEEP()  vTaskDelay(1)
+#elif defined(__arm__)
+#define ADEL_CPU_SLEEP()  __asm__ volatile ("wfi")
+#else
+#define ADEL_CPU_SLEEP()  ;
+#endif
+#endif
 
-// ------------------------------------------------------------
-//   Top-level functions for use in Arduino loop()
-//
-//   You can put as many of these as you'd like in your loop function
+inline void aidle()
+{
+  if (AdelRuntime::anyWake()) {
+    uint32_t t = AdelRuntime::nextWakeMillis();
+    while (adel_before(AdelRuntime::clockMillis(), t) && ! AdelRuntime::anyEvent()) {
+      ADEL_CPU_SLEEP();
+    }
+  } else {
+    if ( ! AdelRuntime::anyEvent()) ADEL_CPU_SLEEP();
+  }
+  AdelRuntime::clearWake();
+}
 
-/** aforever
+/** AdelCores
  *
- *  Run the given Adel function over and over.
+ *  Starts a second loop on the other core. RP2040 boards already run
+ *  setup1() and loop1() on core 1, so this is only needed on ESP32, where
+ *  loop() runs on core 1. A loop on core 0 works just like loop(), with
+ *  its own top-level functions and its own scheduler, if it uses one:
+ *
+ *     void loop0()
+ *     {
+ *       arepeat( readsensors() );
+ *       aidle();
+ *     }
+ *
+ *     void setup()
+ *     {
+ *       AdelCores::startLoop(0, loop0);
+ *     }
+ *
+ *  The loop runs in a FreeRTOS task, which must let the idle task on its
+ *  core run now and then, or the watchdog fires; aidle does that.
  */
-#define arepeat( f )							\
-  static AdelRuntime agensym(aruntime, __LINE__);			\
-  AdelRuntime::curStack = & agensym(aruntime, __LINE__);		\
-  if ( AdelRuntime::curStack->not_running())				\
-    AdelRuntime::curStack->init( f );					\
-  astatus agensym(f_status, __LINE__) = AdelRuntime::curStack->run();	\
-  if (agensym(f_status, __LINE__).done()) {				\
-    AdelRuntime::curStack->reset();					\
+#if ADEL_CORES > 1 && defined(ARDUINO_ARCH_ESP32) && ! defined(ADEL_WORKERS)
+
+#ifndef ADEL_CORE_STACK
+#define ADEL_CORE_STACK 4096
+#endif
+
+class AdelCores
+{
+private:
+  static void task(void * arg) {
+    void (*loop)() = (void (*)()) arg;
+    while (1) loop();
   }
 
-/** aevery
- *  
- *  Run the given Adel function every T milliseconds.
- */
-#define aevery( T, f )							\
-  static AdelRuntime agensym(aruntime, __LINE__);			\
-  AdelRuntime::curStack = & agensym(aruntime, __LINE__);		\
-  static uint32_t agensym(anexttime,__LINE__) = millis() + T;		\
-  if ( AdelRuntime::curStack->not_running())				\
-    AdelRuntime::curStack->init( f );					\
-  astatus agensym(f_status, __LINE__) = AdelRuntime::curStack->run();	\
-  if (agensym(f_status, __LINE__).done() &&				\
-      agensym(anexttime,__LINE__) < millis()) {				\
-    AdelRuntime::curStack->reset();					\
-    agensym(anexttime,__LINE__) += T;					\
+public:
+  // -- Run loop() over and over on the given core. Returns false if the
+  //    task could not be created.
+  static inline bool startLoop(uint8_t core, void (*loop)(),
+                               uint32_t stack = ADEL_CORE_STACK) {
+    return xTaskCreatePinnedToCore(& AdelCores::task, "adel", stack,
+                                   (void *) loop, 1, 0, core) == pdPASS;
   }
+};
 
-/** aonce
- *
- *  Run an adel function from the top one time. Once complete, the program
- *  stops running and nothing will happen on the microcontroller until it
- *  is restarted. Probably not what you want!
- */
-#define aonce( f )							\
-  static AdelRuntime agensym(aruntime, __LINE__);			\
-  AdelRuntime::curStack = & agensym(aruntime, __LINE__);		\
-  if (AdelRuntime::curStack->not_running())				\
-     AdelRuntime::curStack->init( f );					\
-  AdelRuntime::curStack->run();
+#endif
 
 // ------------------------------------------------------------
 //   Function prologue and epilogue
@@ -273,6 +2874,30 @@ public:
  */
 #define adel AdelAR * __attribute__((warn_unused_result)) 
 
+/** aforkable
+ *
+ *  Declares an Adel function that afork can embed. It works everywhere
+ *  that an adel function does, but its return type is deduced, so callers
+ *  can see the exact type of its AR. Like any function with a deduced
+ *  return type, it has to be defined before it is called. Deducing the
+ *  type needs C++14. Under C++11 (what the AVR boards use unless told
+ *  otherwise), aforkable is just adel, and afork falls back to aboth or
+ *  athree, so the same code still works, only with its children on the
+ *  heap.
+ *
+ *     aforkable blink(int pin, int ms)
+ *     {
+ *       abegin:
+ *       ...
+ *       aend;
+ *     }
+ */
+#if __cplusplus >= 201402L
+#define aforkable auto __attribute__((warn_unused_result))
+#else
+#define aforkable adel
+#endif
+
 /** abegin
  *
  * Always add abegin and aend to every adel function. These macros wrap the
@@ -283,15 +2908,29 @@ public:
  * captured and later copied into the LocalAdelAR.
  */
 #define abegin								\
-  const char * a_fun_name = __FUNCTION__;				\
-  /* -- These variables become the persistent state in the closure */	\
-  uint16_t adel_pc = 0;							\
-  uint32_t adel_wait = 0;						\
-  uint32_t adel_ramp_start = 0;						\
+  adel_fun_name								\
+  /* -- These variables become the persistent state in the closure, */	\
+  /*    but only the ones the body actually uses get captured */	\
+  enum { adel_pc_base = __COUNTER__ };					\
+  ADEL_PC_TYPE adel_pc = 0;						\
+  uint32_t adel_wait __attribute__((unused)) = 0;			\
+  uint32_t adel_ramp_start __attribute__((unused)) = 0;			\
+  uint32_t adel_ramp_rate __attribute__((unused)) = 0;			\
+  AdelChildren adel_children __attribute__((unused));			\
+  AdelSleepers adel_sleepers __attribute__((unused));			\
+  adel_profile_find							\
+  adel_trace_find							\
   /* ----- Start the lambda -- the body of the function ----- */	\
-  auto adel_body = [=](AdelAR * a_ar) mutable {				\
+  auto adel_body = [=](bool adel_stopping) mutable {			\
     astatus f_status, g_status, h_status;				\
-    if (adel_pc == 0) { adel_debug("abegin", __LINE__);}		\
+    /* -- Stopping goes to aonstop, or else to the end */		\
+    if (adel_stopping) {						\
+      if (adel_pc == 0 || adel_pc == ADEL_FINALLY)			\
+        return astatus::ADONE;						\
+      adel_pc = ADEL_STOP;						\
+    }									\
+    adel_profile_run							\
+    if (adel_pc == 0) { adel_debug(abegin, __LINE__);}			\
     switch (adel_pc) {							\
    case 0
 
@@ -303,12 +2942,14 @@ public:
 #define aend								\
         case ADEL_FINALLY: ;						\
       }									\
-      adel_debug("aend", __LINE__);					\
+      adel_debug(aend, __LINE__);					\
       adel_pc = ADEL_FINALLY;						\
       return astatus::ADONE;						\
     };									\
+  static_assert(adel_here <= (ADEL_PC_TYPE) -1,				\
+                "too many steps for ADEL_PC_TYPE in this Adel function"); \
   /* -- Make and return the new AR */					\
-  return new LocalAdelAR<decltype(adel_body)>(adel_body);
+  return adel_new(adel_body);
 
 // ------------------------------------------------------------
 //   General Adel functions
@@ -317,12 +2958,34 @@ public:
  *
  *  Semantics: delay this function for t milliseconds
  */
-#define adelay(t)							\
-    adel_pc = anextstep;						\
-    adel_wait = millis() + t;						\
-    adel_debug("adelay", __LINE__);					\
- case anextstep:							\
-    if (millis() < adel_wait) return astatus::ACONT;
+#define adelay(t) adel_adelay(t, adel_here)
+#define adel_adelay(t, pc)						\
+    adel_pc = (pc);							\
+    adel_wait = AdelRuntime::now() + (t);				\
+    adel_debug(adelay, __LINE__);					\
+ case (pc):								\
+    if (adel_before(AdelRuntime::now(), adel_wait)) {			\
+      AdelRuntime::curStack->wakeat(adel_wait);				\
+      return astatus::ACONT;						\
+    }									\
+    adel_profile_wake(adel_wait)
+
+/** audelay
+ *
+ *  Semantics: delay this function for t microseconds. The delay is only
+ *  as precise as the time between passes, so keep the other functions
+ *  short when using it for pulse trains or bit-banging.
+ */
+#define audelay(t) adel_audelay(t, adel_here)
+#define adel_audelay(t, pc)						\
+    adel_pc = (pc);							\
+    adel_wait = AdelRuntime::nowMicros() + (t);				\
+    adel_debug(audelay, __LINE__);					\
+ case (pc):								\
+    if (adel_before(AdelRuntime::nowMicros(), adel_wait)) {		\
+      AdelRuntime::curStack->wakeatmicros(adel_wait);			\
+      return astatus::ACONT;						\
+    }
 
 /** andthen
  *
@@ -331,24 +2994,124 @@ public:
  *     andthen( turn_on_light() );
  *     andthen( turn_off_light() );
  */
-#define andthen( f )							\
-    adel_pc = anextstep;						\
-    a_ar->init(0, f );							\
-    adel_debug("andthen", __LINE__);					\
-  case anextstep:							\
-    f_status = a_ar->runchild(0);					\
+#define andthen( f ) adel_andthen( f, adel_here )
+#define adel_andthen( f, pc )						\
+    adel_pc = (pc);							\
+    adel_children.init(0, f );						\
+    adel_debug(andthen, __LINE__);					\
+  case (pc):								\
+    f_status = adel_children.runchild(0);				\
     if ( f_status.notdone() ) return astatus::ACONT;			\
-    a_ar->clear(0);
+    adel_children.clear();
 
 /** await
  *  Wait asynchronously for a condition to become true. Note that this
  *  condition CANNOT be an adel function.
  */
-#define await( c )							\
-    adel_pc = anextstep;						\
-    adel_debug("await", __LINE__);					\
-  case anextstep:							\
-    if ( ! ( c ) ) return astatus::ACONT
+#define await( c ) adel_await( c, adel_here )
+#define adel_await( c, pc )						\
+    adel_pc = (pc);							\
+    adel_debug(await, __LINE__);					\
+  case (pc):								\
+    if ( ! ( c ) ) {							\
+      AdelRuntime::curStack->wakenow();					\
+      return astatus::ACONT;						\
+    }
+
+/** ayieldif
+ *
+ *  If condition c is true, give the other functions a turn and continue
+ *  from here on the next pass. Otherwise keep going right away.
+ */
+#define ayieldif( c ) adel_ayieldif( c, adel_here )
+#define adel_ayieldif( c, pc )						\
+    adel_pc = (pc);							\
+    if ( c ) {								\
+      adel_debug(ayieldif, __LINE__);					\
+      AdelRuntime::curStack->wakenow();					\
+      return astatus::ACONT;						\
+    }									\
+  case (pc):
+
+/** acheckpoint
+ *
+ *  Yield, as in ayieldif, only if the current pass has run longer than
+ *  the pass budget (see AdelRuntime::passBudget). Put it inside a long
+ *  computation, so the computation is spread over several passes when it
+ *  takes too long, and costs little more than a call to micros() when it
+ *  doesn't:
+ *
+ *     for (i = 0; i < 500; i++) {
+ *       sum += expensive(i);
+ *       acheckpoint;
+ *     }
+ */
+#define acheckpoint							\
+  ayieldif( AdelRuntime::overBudget() )
+
+/** awaitevent
+ *
+ *  Wait for an AdelEvent to be signaled, typically by an interrupt handler
+ *  (see AdelEvent). The function is not run again until an event is
+ *  signaled, so this is much cheaper than polling with await:
+ *
+ *     awaitevent( pressed );
+ */
+#define awaitevent( e ) adel_awaitevent( e, adel_here )
+#define adel_awaitevent( e, pc )					\
+    adel_pc = (pc);							\
+    adel_debug(awaitevent, __LINE__);					\
+  case (pc):								\
+    if ( ! (e).take() ) {						\
+      AdelRuntime::curStack->waitevent();				\
+      return astatus::ACONT;						\
+    }
+
+/** awaitdata
+ *
+ *  Wait until queue or channel q has something in it, without taking it
+ *  out. Like awaitevent, the function is not run again until something is
+ *  sent to q (or some other function is woken up).
+ */
+#define awaitdata( q ) adel_awaitdata( q, adel_here )
+#define adel_awaitdata( q, pc )						\
+    adel_pc = (pc);							\
+    adel_debug(awaitdata, __LINE__);					\
+  case (pc):								\
+    if ( (q).waitData() ) {						\
+      AdelRuntime::curStack->waitevent();				\
+      return astatus::ACONT;						\
+    }
+
+/** asend
+ *
+ *  Send value v on AdelChannel ch, waiting first for room if the channel
+ *  is full.
+ */
+#define asend( ch, v ) adel_asend( ch, v, adel_here )
+#define adel_asend( ch, v, pc )						\
+    adel_pc = (pc);							\
+    adel_debug(asend, __LINE__);					\
+  case (pc):								\
+    if ( ! (ch).send( v ) ) {						\
+      AdelRuntime::curStack->waitevent();				\
+      return astatus::ACONT;						\
+    }
+
+/** areceive
+ *
+ *  Receive the next value from AdelChannel ch into variable v, waiting for
+ *  one to be sent if the channel is empty.
+ */
+#define areceive( ch, v ) adel_areceive( ch, v, adel_here )
+#define adel_areceive( ch, v, pc )					\
+    adel_pc = (pc);							\
+    adel_debug(areceive, __LINE__);					\
+  case (pc):								\
+    if ( ! (ch).receive( v ) ) {					\
+      AdelRuntime::curStack->waitevent();				\
+      return astatus::ACONT;						\
+    }
 
 /** aforatmost
  *
@@ -364,21 +3127,47 @@ public:
  *  The way this is implemented in adel is sneaky -- we use the adel PC as
  *  a way to remember whether the function finished or not.
  */
-#define aforatmost( t, f )						\
-    adel_pc = anextstep;						\
-    a_ar->init(0, f );							\
-    adel_wait = millis() + t;						\
-    adel_debug("aforatmost", __LINE__);					\
-  case anextstep:							\
-    f_status = a_ar->runchild(0);					\
-    if (f_status.notdone() && millis() < adel_wait)			\
+#define aforatmost( t, f ) adel_aforatmost( t, f, adel_here3 )
+#define adel_aforatmost( t, f, pc )					\
+    adel_pc = (pc);							\
+    adel_children.init(0, f );						\
+    adel_wait = AdelRuntime::now() + (t);				\
+    adel_debug(aforatmost, __LINE__);					\
+  case (pc):								\
+    f_status = adel_children.runchild(0);				\
+    if (f_status.notdone() && adel_before(AdelRuntime::now(), adel_wait)) { \
+      AdelRuntime::curStack->wakeat(adel_wait);				\
+      return astatus::ACONT;						\
+    }									\
+    adel_children.clear();						\
+    if (f_status.done()) adel_pc = (pc + 1);				\
+    else                 adel_pc = (pc + 2);				\
+  case (pc + 1):							\
+  case (pc + 2):							\
+  if ( adel_pc != (pc + 1) )
+
+/** auforatmost
+ *
+ *  Semantics: same as aforatmost, but the timeout t is in microseconds.
+ */
+#define auforatmost( t, f ) adel_auforatmost( t, f, adel_here3 )
+#define adel_auforatmost( t, f, pc )					\
+    adel_pc = (pc);							\
+    adel_children.init(0, f );						\
+    adel_wait = AdelRuntime::nowMicros() + (t);				\
+    adel_debug(auforatmost, __LINE__);					\
+  case (pc):								\
+    f_status = adel_children.runchild(0);				\
+    if (f_status.notdone() && adel_before(AdelRuntime::nowMicros(), adel_wait)) { \
+      AdelRuntime::curStack->wakeatmicros(adel_wait);			\
       return astatus::ACONT;						\
-    a_ar->clear(0);							\
-    if (f_status.done()) adel_pc = alaterstep(1);			\
-    else                 adel_pc = alaterstep(2);			\
-  case alaterstep(1):							\
-  case alaterstep(2):							\
-  if ( adel_pc != alaterstep(1) )
+    }									\
+    adel_children.clear();						\
+    if (f_status.done()) adel_pc = (pc + 1);				\
+    else                 adel_pc = (pc + 2);				\
+  case (pc + 1):							\
+  case (pc + 2):							\
+  if ( adel_pc != (pc + 1) )
     
 /** aboth
  *
@@ -386,35 +3175,145 @@ public:
  *  (both return false). Example use:
  *      aboth( flash_led(), play_sound() );
  */
-#define aboth( f , g )							\
-    adel_pc = anextstep;						\
-    a_ar->init(0, f );							\
-    a_ar->init(1, g );							\
-    adel_debug("aboth", __LINE__);					\
-  case anextstep:							\
-    f_status = a_ar->runchild(0);					\
-    g_status = a_ar->runchild(1);					\
+#define aboth( f , g ) adel_aboth( f , g, adel_here )
+#define adel_aboth( f , g, pc )						\
+    adel_pc = (pc);							\
+    adel_children.init(0, f );						\
+    adel_children.init(1, g );						\
+    adel_debug(aboth, __LINE__);					\
+  case (pc):								\
+    f_status = adel_children.runchild(0);				\
+    g_status = adel_children.runchild(1);				\
     if (f_status.notdone() || g_status.notdone())			\
       return astatus::ACONT;						\
-    a_ar->clear(0);							\
-    a_ar->clear(1);
+    adel_children.clear();
+
+/** afork
+ *
+ *  Semantics: like aboth or athree, execute two or three functions
+ *  asynchronously, until all are done, but without allocating their ARs.
+ *  The functions must be declared with aforkable, and the slots for them
+ *  declared above abegin with aforkslots, naming the functions in the same
+ *  order:
+ *
+ *     adel twoblinks()
+ *     {
+ *       aforkslots( kids, blink, blink );
+ *       abegin:
+ *       afork( kids, blink(3, 500), blink(4, 500) );
+ *       aend;
+ *     }
+ *
+ *  The arguments of the calls themselves should not call Adel functions.
+ *  Without C++14 there are no slots (see aforkable), and afork is aboth
+ *  or athree.
+ */
+#define adel_afork_pick( a, b, c, name, ... ) name
+
+#if __cplusplus >= 201402L
+
+#define aforkslots( k, ... )						\
+  adel_afork_pick(__VA_ARGS__, adel_forkslots3, adel_forkslots2, )(k, __VA_ARGS__)
+#define adel_forkslots2( k, f, g )					\
+  AdelFork<decltype(adel_fork_ar(& f)), decltype(adel_fork_ar(& g))> k
+#define adel_forkslots3( k, f, g, h )					\
+  AdelFork<decltype(adel_fork_ar(& f)), decltype(adel_fork_ar(& g)),	\
+           decltype(adel_fork_ar(& h))> k
+
+#define afork( k, ... )							\
+  adel_afork_pick(__VA_ARGS__, adel_afork3, adel_afork2, )(k, __VA_ARGS__, adel_here)
+#define adel_afork2( k, f, g, pc )					\
+    adel_pc = (pc);							\
+    (k).clear();							\
+    (k).offer();							\
+    (k).start( f );							\
+    (k).rest.offer();							\
+    (k).rest.start( g );						\
+    adel_debug(afork, __LINE__);					\
+  case (pc):								\
+    if ((k).runall().notdone())						\
+      return astatus::ACONT;						\
+    (k).clear();
+#define adel_afork3( k, f, g, h, pc )					\
+    adel_pc = (pc);							\
+    (k).clear();							\
+    (k).offer();							\
+    (k).start( f );							\
+    (k).rest.offer();							\
+    (k).rest.start( g );						\
+    (k).rest.rest.offer();						\
+    (k).rest.rest.start( h );						\
+    adel_debug(afork, __LINE__);					\
+  case (pc):								\
+    if ((k).runall().notdone())						\
+      return astatus::ACONT;						\
+    (k).clear();
+#else
+#define aforkslots( k, ... )						\
+  typedef void k __attribute__((unused))
+
+#define afork( k, ... )							\
+  adel_afork_pick(__VA_ARGS__, adel_athree, adel_aboth, )(__VA_ARGS__, adel_here)
+#endif
 
 /** athree
  *
  *  Semantics: execute f, g, and h asynchronously, until *all* are done.
  */
-#define athree( f , g , h )						\
-    adel_pc = anextstep;						\
-    a_ar->init(0, f );							\
-    a_ar->init(1, g );							\
-    a_ar->init(2, h );							\
-    adel_debug("athree", __LINE__);					\
-  case anextstep:							\
-    f_status = a_ar->runchild(0);					\
-    g_status = a_ar->runchild(1);					\
-    h_status = a_ar->runchild(2);					\
+#define athree( f , g , h ) adel_athree( f , g , h, adel_here )
+#define adel_athree( f , g , h, pc )					\
+    adel_pc = (pc);							\
+    adel_children.init(0, f );						\
+    adel_children.init(1, g );						\
+    adel_children.init(2, h );						\
+    adel_debug(athree, __LINE__);					\
+  case (pc):								\
+    f_status = adel_children.runchild(0);				\
+    g_status = adel_children.runchild(1);				\
+    h_status = adel_children.runchild(2);				\
     if (f_status.notdone() || g_status.notdone() || h_status.notdone())	\
-      return astatus::ACONT;
+      return astatus::ACONT;						\
+    adel_children.clear();
+
+/** aall
+ *
+ *  Semantics: execute n copies of f asynchronously, until *all* are done.
+ *  The variable i counts from 0 to n-1 as the copies are started, so f can
+ *  depend on it. For example, to blink eight LEDs at different rates:
+ *
+ *     aall( i, 8, blink(pins[i], 100 + 50*i) );
+ */
+#define aall( i, n, f ) adel_aall( i, n, f, adel_here )
+#define adel_aall( i, n, f, pc )					\
+    adel_pc = (pc);							\
+    for (i = 0; i < (n); i++) adel_children.init(i, f );		\
+    adel_sleepers.init(adel_children, n);				\
+    adel_debug(aall, __LINE__);						\
+  case (pc):								\
+    if (adel_sleepers.runall(adel_children).notdone())			\
+      return astatus::ACONT;						\
+    adel_sleepers.clear();						\
+    adel_children.clear();
+
+/** aany
+ *
+ *  Semantics: execute n copies of f asynchronously, until *any* of them
+ *  is done. As in aall, the variable i counts up as the copies are
+ *  started. When aany finishes, i is set to the number of the copy that
+ *  finished first, so i should be declared above abegin:
+ *
+ *     aany( i, 4, waitbutton(buttons[i]) );
+ *     digitalWrite(leds[i], HIGH);
+ */
+#define aany( i, n, f ) adel_aany( i, n, f, adel_here )
+#define adel_aany( i, n, f, pc )					\
+    adel_pc = (pc);							\
+    for (i = 0; i < (n); i++) adel_children.init(i, f );		\
+    adel_debug(aany, __LINE__);						\
+  case (pc):								\
+    i = adel_children.runany();						\
+    if (i < 0) return astatus::ACONT;					\
+    adel_children.clear();
 
 /** auntil
  *
@@ -430,23 +3329,100 @@ public:
  *        // light finished first
  *     }
  */
-#define auntil( f , g )							\
-    adel_pc = anextstep;						\
-    a_ar->init(0, f );							\
-    a_ar->init(1, g );							\
-    adel_debug("auntil", __LINE__);					\
-  case anextstep:							\
-    f_status = a_ar->runchild(0);					\
-    g_status = a_ar->runchild(1);					\
+#define auntil( f , g ) adel_auntil( f , g, adel_here3 )
+#define adel_auntil( f , g, pc )					\
+    adel_pc = (pc);							\
+    adel_children.init(0, f );						\
+    adel_children.init(1, g );						\
+    adel_debug(auntil, __LINE__);					\
+  case (pc):								\
+    f_status = adel_children.runchild(0);				\
+    g_status = adel_children.runchild(1);				\
     if (f_status.notdone() && g_status.notdone())			\
       return astatus::ACONT;						\
-    a_ar->clear(0);							\
-    a_ar->clear(1);							\
-    if (f_status.done()) adel_pc = alaterstep(1);			\
-    else                 adel_pc = alaterstep(2);			\
-  case alaterstep(1):							\
-  case alaterstep(2):							\
-  if ( adel_pc == alaterstep(1) )
+    adel_children.clear();						\
+    if (f_status.done()) adel_pc = (pc + 1);				\
+    else                 adel_pc = (pc + 2);				\
+  case (pc + 1):							\
+  case (pc + 2):							\
+  if ( adel_pc == (pc + 1) )
+
+/** AdelEase
+ *
+ *  Easing curves for aramp_ease, all in fixed point. The phase of a ramp
+ *  goes from 0 to 65536 (ONE) over its duration, and each curve maps it to
+ *  a fraction of the way from start to end, on the same scale:
+ *
+ *    ALINEAR : constant speed, like aramp
+ *    AQUAD   : starts slowly and speeds up (phase squared)
+ *    ASINE   : starts and ends slowly (half a cosine wave)
+ *    AGAMMA  : gamma 2.2, so an LED driven with analogWrite appears to
+ *              brighten (or dim) at a constant rate. The curve applies to
+ *              the level, so a ramp down is a ramp up played backward.
+ *
+ *  The curves are tables of 17 points, with straight lines in between.
+ */
+class AdelEase
+{
+public:
+  enum { ALINEAR, AQUAD, ASINE, AGAMMA };
+
+  static const uint32_t ONE = 65536;
+
+private:
+  static inline uint16_t point(uint8_t curve, uint8_t i) {
+    static const uint16_t tables[3][17] ADEL_TABLE = {
+      { 0, 256, 1024, 2304, 4096, 6400, 9216, 12544, 16384,
+        20736, 25600, 30976, 36863, 43263, 50175, 57599, 65535 },
+      { 0, 630, 2494, 5522, 9597, 14563, 20228, 26375, 32767,
+        39160, 45307, 50972, 55938, 60013, 63041, 64905, 65535 },
+      { 0, 147, 676, 1648, 3104, 5072, 7574, 10632, 14263,
+        18482, 23303, 28739, 34802, 41503, 48853, 56860, 65535 } };
+    return adel_table_read(tables[curve - 1], i);
+  }
+
+public:
+  // -- Phase per millisecond, scaled up by 256. This is the only division,
+  //    and it happens once at the start of the ramp.
+  static inline uint32_t rate(uint32_t T) {
+    uint32_t r = T ? (ONE << 8) / T : 1;
+    return r ? r : 1;
+  }
+
+  // -- Phase at the current time. Once the time is up, the phase is ONE
+  //    and rate is set to zero, which ends the ramp after this pass.
+  static inline uint32_t phase(uint32_t start, uint32_t & r, uint32_t T) {
+    uint32_t elapsed = AdelRuntime::now() - start;
+    if (elapsed >= T) {
+      r = 0;
+      return ONE;
+    }
+    uint32_t p = (elapsed * r) >> 8;
+    return p < ONE ? p : ONE - 1;
+  }
+
+  // -- The value between start and end at phase p
+  static inline long value(uint8_t curve, long start, long end, uint32_t p) {
+    if (p >= ONE) return end;
+    if (curve == AGAMMA && end < start) {
+      // -- Gamma belongs to the level, not the time: fading down is the
+      //    same as fading up, backward
+      long t = start;
+      start = end;
+      end = t;
+      p = ONE - p;
+      if (p >= ONE) return end;
+    }
+    uint32_t y = p;
+    if (curve != ALINEAR) {
+      uint8_t i = p >> 12;
+      int32_t a = point(curve, i);
+      int32_t b = point(curve, i + 1);
+      y = a + (((b - a) * (int32_t) (p & 0xFFF)) >> 12);
+    }
+    return start + (((end - start) * (int32_t) (y >> 4)) >> 12);
+  }
+};
 
 /** ramp
  *
@@ -464,13 +3440,43 @@ public:
  *        the loop body.
  */
 #define aramp( T, v, start, end)					\
-    adel_pc = anextstep;						\
-    adel_ramp_start = millis();						\
-    adel_debug("aramp", __LINE__);					\
- case anextstep:							\
-    while ((millis() <= (adel_ramp_start + T)) &&			\
-           ((v = map(millis(), adel_ramp_start, adel_ramp_start + T, start, end)) == v) && \
-           (adel_pc = anextstep))
+  adel_aramp( T, v, start, end, adel_here )
+#define adel_aramp( T, v, start, end, pc )				\
+    adel_pc = (pc);							\
+    adel_ramp_start = AdelRuntime::now();				\
+    adel_debug(aramp, __LINE__);					\
+ case (pc):								\
+    while (((uint32_t) (AdelRuntime::now() - adel_ramp_start) <= (uint32_t) (T)) && \
+           ((v = map(AdelRuntime::now() - adel_ramp_start, 0, T, start, end)) == v) && \
+           (adel_pc = (pc)))
+
+/** aramp_ease
+ *
+ *  Like aramp, but v follows one of the AdelEase curves from start to end,
+ *  and it reaches end exactly: the body always runs one last time with
+ *  v equal to end. The values are computed in fixed point, with no
+ *  division after the start, so this is cheap enough for many ramps at
+ *  once:
+ *
+ *       aramp_ease(1000, v, 0, 255, AdelEase::AGAMMA) {
+ *         analogWrite(pin, v);
+ *         adelay(20);
+ *       }
+ *
+ *  start and end must be no more than about 500,000 apart.
+ */
+#define aramp_ease( T, v, start, end, curve )				\
+  adel_aramp_ease( T, v, start, end, curve, adel_here )
+#define adel_aramp_ease( T, v, start, end, curve, pc )			\
+    adel_pc = (pc);							\
+    adel_ramp_start = AdelRuntime::now();				\
+    adel_ramp_rate = AdelEase::rate(T);					\
+    adel_debug(aramp, __LINE__);					\
+ case (pc):								\
+    while ((adel_ramp_rate != 0) &&					\
+           ((v = AdelEase::value(curve, start, end,			\
+                   AdelEase::phase(adel_ramp_start, adel_ramp_rate, T))), true) && \
+           (adel_pc = (pc)))
 
 /** alternate
  * 
@@ -479,38 +3485,43 @@ public:
  *  calls "ayourturn", at which point continue executing the first one
  *  where it left off. Continue until either one finishes.
  */
-#define alternate( f , g )						\
-    adel_pc = alaterstep(0);						\
-    a_ar->init(0, f );							\
-    a_ar->init(1, g );							\
-    adel_debug("alternate", __LINE__);					\
-  case alaterstep(0):							\
-    f_status = a_ar->runchild(0);					\
+#define alternate( f , g ) adel_alternate( f , g, adel_here3 )
+#define adel_alternate( f , g, pc )					\
+    adel_pc = (pc);							\
+    adel_children.init(0, f );						\
+    adel_children.init(1, g );						\
+    adel_debug(alternate, __LINE__);					\
+  case (pc):								\
+    f_status = adel_children.runchild(0);				\
     if (f_status.cont()) return astatus::ACONT;				\
     if (f_status.yield()) {						\
-	adel_pc = alaterstep(1);					\
+	adel_pc = (pc + 1);						\
+        AdelRuntime::curStack->wakenow();				\
         return astatus::ACONT;						\
     } else								\
-        adel_pc = alaterstep(2);					\
-  case alaterstep(1):							\
-    g_status = a_ar->runchild(1);					\
+        adel_pc = (pc + 2);						\
+  case (pc + 1):							\
+    g_status = adel_children.runchild(1);				\
     if (g_status.cont()) return astatus::ACONT;				\
     if (g_status.yield()) {						\
-	adel_pc = alaterstep(0);					\
+	adel_pc = (pc);							\
+        AdelRuntime::curStack->wakenow();				\
         return astatus::ACONT;						\
     }									\
-  case alaterstep(2):
+  case (pc + 2):							\
+    adel_children.clear();
 
 /** ayourturn
  *
  *  Use only in functions being called by "alternate". Stop executing this
  *  function and start executing the other function.
  */
-#define ayourturn							\
-    adel_pc = anextstep;						\
-    adel_debug("ayourturn", __LINE__);					\
+#define ayourturn adel_ayourturn( adel_here )
+#define adel_ayourturn( pc )						\
+    adel_pc = (pc);							\
+    adel_debug(ayourturn, __LINE__);					\
     return astatus::AYIELD;						\
-  case anextstep: ;
+  case (pc): ;
 
 /** afinish
  * 
@@ -519,7 +3530,166 @@ public:
  */
 #define afinish							\
     adel_pc = ADEL_FINALLY;					\
-    adel_debug("afinish", __LINE__);				\
+    adel_debug(afinish, __LINE__);					\
+    AdelRuntime::curStack->wakenow();					\
     return astatus::ACONT;
 
+/** aonstop
+ *
+ *  Semantics: run the block that follows only if the function is stopped
+ *  before it is done -- because auntil, aforatmost, aany or alternate
+ *  gave up on it, or its caller was stopped -- and then leave the
+ *  function. Use it to turn off pins, release resources, and so on:
+ *
+ *    adel blink(int pin, int ms)
+ *    {
+ *      abegin:
+ *      aonstop {
+ *        digitalWrite(pin, LOW);
+ *      }
+ *      while (1) { ... }
+ *      aend;
+ *    }
+ *
+ *  The function's local variables have the values they had when it last
+ *  yielded. The block runs to the end in one go, so it should not contain
+ *  any Adel constructs (or break out of it). Normal runs skip it, so it
+ *  can go anywhere in the body, but there can be only one. The loop runs
+ *  just once, because its increment leaves the function, using a GNU
+ *  statement expression.
+ */
+#define aonstop								\
+    if (false)								\
+  case ADEL_STOP:							\
+      for (;; ({ adel_debug(aonstop, __LINE__);				\
+                 adel_pc = ADEL_FINALLY;				\
+                 return astatus::ADONE; }))
+
+// ------------------------------------------------------------
+//   Library Adel functions
+
+/** Stream input
+ *
+ *  Each pass reads everything the stream has available, up to
+ *  ADEL_READ_BUDGET bytes, so that a burst of input does not hold up the
+ *  other functions. When nothing is available, the reader checks again
+ *  every ADEL_READ_POLL milliseconds.
+ */
+#ifndef ADEL_READ_BUDGET
+#define ADEL_READ_BUDGET 32
+#endif
+
+#ifndef ADEL_READ_POLL
+#define ADEL_READ_POLL 1
+#endif
+
+/** adel_readstream
+ *
+ *  Common code for areadline and areadbytes: read up to n bytes from the
+ *  stream into buf, stopping early at delim (unless it is negative), or
+ *  when timeout milliseconds go by without a byte (unless it is zero). The
+ *  timeout only starts once the first byte has arrived. The number of
+ *  bytes read goes in *count. In line mode, buf is null-terminated (so at
+ *  most n-1 bytes are read), the delimiter is not stored, and a carriage
+ *  return before a newline is dropped.
+ */
+inline adel adel_readstream(Stream & in, uint8_t * buf, size_t n, int delim,
+                            uint32_t timeout, size_t * count, bool line)
+{
+  // -- Keep a pointer, since the lambda would otherwise copy the stream
+  Stream * port = & in;
+  size_t got = 0;
+  size_t room = (line && n > 0) ? n - 1 : n;
+  uint32_t last = 0;
+  // -- With no room at all, finish without reading anything
+  bool done = (room == 0);
+  abegin:
+  if (line && n > 0) buf[0] = 0;
+  if (count) * count = 0;
+  while ( ! done) {
+    {
+      uint8_t budget = ADEL_READ_BUDGET;
+      while ( ! done && budget > 0 && port->available() > 0) {
+        int c = port->read();
+        if (c < 0) {
+          budget = 0;
+        } else {
+          budget--;
+          last = AdelRuntime::now();
+          if (c == delim)
+            done = true;
+          else if ( ! (line && c == '\r' && delim == '\n')) {
+            buf[got++] = c;
+            if (line) buf[got] = 0;
+          }
+          if (got == room) done = true;
+        }
+      }
+      if (got > 0 && timeout && ! adel_before(AdelRuntime::now(), last + timeout))
+        done = true;
+      if (count) * count = got;
+    }
+    if ( ! done) {
+      adelay(ADEL_READ_POLL);
+    }
+  }
+  aend;
+}
+
+/** areadline
+ *
+ *  Read a line of text from a stream (Serial, for example) into buf, which
+ *  holds n characters including the terminating null. The line ends at the
+ *  delimiter (a newline by default), which is not stored, when the buffer
+ *  is full, or when timeout milliseconds go by after the last character
+ *  (if timeout is not zero):
+ *
+ *     char command[21];
+ *     ...
+ *     andthen( areadline(Serial, command, sizeof(command), 50) );
+ */
+inline adel areadline(Stream & in, char * buf, size_t n,
+                      uint32_t timeout = 0, char delim = '\n')
+{
+  return adel_readstream(in, (uint8_t *) buf, n, (uint8_t) delim, timeout, 0, true);
+}
+
+/** areadbytes
+ *
+ *  Read n bytes from a stream into buf, or as many as arrive before
+ *  timeout milliseconds go by after the last one (if timeout is not zero).
+ *  If count is not null, it gets the number of bytes read.
+ */
+inline adel areadbytes(Stream & in, uint8_t * buf, size_t n,
+                       size_t * count = 0, uint32_t timeout = 0)
+{
+  return adel_readstream(in, buf, n, -1, timeout, count, false);
+}
+
+#ifdef ADEL_TRACE
+
+/** atraceflush
+ *
+ *  Write out trace records in the background, a few at a time, every
+ *  interval milliseconds (see AdelTrace). Run it as a separate top-level
+ *  function, so it does not get in the way of anything else:
+ *
+ *     arepeat( atraceflush(Serial, 10) );
+ */
+inline adel atraceflush(Print & out, uint32_t interval)
+{
+  // -- Keep a pointer, since the lambda would otherwise copy the stream
+  Print * port = & out;
+  abegin:
+  // -- Don't fill the buffer with records about emptying it
+  a_trace_id = AdelTrace::UNTRACED;
+  while (1) {
+    AdelTrace::drain(* port, ADEL_TRACE_BURST);
+    adelay(interval);
+  }
+  aend;
+}
+
+#endif
+
 #endif
@@ -0,0 +1,106 @@
+/***********************************************************************
+ *
+ * Adel host benchmark -- Arduino shim
+ *
+ * Just enough of the Arduino API to compile adel.h on a desktop. Time
+ * comes from a virtual clock that only moves when the benchmark moves it
+ * (see adel_mock_advance), so runs are repeatable.
+ *
+ ***********************************************************************/
+
+#ifndef ADEL_MOCK_ARDUINO_H
+#define ADEL_MOCK_ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+// -- Virtual clock, in microseconds
+inline uint64_t & adel_mock_clock()
+{
+  static uint64_t now_us = 0;
+  return now_us;
+}
+
+inline void adel_mock_advance(uint64_t us) { adel_mock_clock() += us; }
+
+// -- Like the AVR and ARM cores, these wrap around at 32 bits
+inline uint32_t millis() { return (uint32_t) (adel_mock_clock() / 1000); }
+inline uint32_t micros() { return (uint32_t) adel_mock_clock(); }
+inline void delay(uint32_t ms) { adel_mock_advance((uint64_t) ms * 1000); }
+inline void delayMicroseconds(uint32_t us) { adel_mock_advance(us); }
+
+inline long map(long x, long in_min, long in_max, long out_min, long out_max)
+{
+  return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+// -- Pins do nothing, but remember what was written to them
+inline int * adel_mock_pins()
+{
+  static int pins[64];
+  return pins;
+}
+
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t pin, uint8_t val) { adel_mock_pins()[pin & 63] = val; }
+inline int digitalRead(uint8_t pin) { return adel_mock_pins()[pin & 63]; }
+inline void analogWrite(uint8_t pin, int val) { adel_mock_pins()[pin & 63] = val; }
+inline int analogRead(uint8_t pin) { return adel_mock_pins()[pin & 63]; }
+
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+// -- Print and Stream write to stdout; Stream never has input
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) { return fputc(c, stdout) == EOF ? 0 : 1; }
+  size_t write(const uint8_t * buf, size_t n) {
+    size_t w = 0;
+    while (n--) w += write(*buf++);
+    return w;
+  }
+  virtual int availableForWrite() { return 64; }
+
+  size_t print(const char * s) { return write((const uint8_t *) s, strlen(s)); }
+  size_t print(char c) { return write((uint8_t) c); }
+  size_t print(long v) { char b[24]; snprintf(b, sizeof(b), "%ld", v); return print(b); }
+  size_t print(unsigned long v) { char b[24]; snprintf(b, sizeof(b), "%lu", v); return print(b); }
+  size_t print(int v) { return print((long) v); }
+  size_t print(unsigned int v) { return print((unsigned long) v); }
+  size_t print(unsigned char v) { return print((unsigned long) v); }
+  size_t print(double v) { char b[32]; snprintf(b, sizeof(b), "%.2f", v); return print(b); }
+
+  size_t println() { return print('\n'); }
+  template<typename T> size_t println(T v) { size_t n = print(v); return n + println(); }
+};
+
+class Stream : public Print
+{
+public:
+  virtual int available() { return 0; }
+  virtual int read() { return -1; }
+  virtual int peek() { return -1; }
+};
+
+class HardwareSerial : public Stream
+{
+public:
+  void begin(unsigned long) {}
+  operator bool() { return true; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,456 @@
+/***********************************************************************
+ *
+ * Adel host benchmark
+ *
+ * Runs synthetic Adel workloads against the Arduino shim in this
+ * directory and reports, for each one, the host time per pass, the number
+ * of heap allocations per pass, and the peak heap in use. Build and run
+ * with "make run" in this directory. An optional argument sets the number
+ * of passes per workload:
+ *
+ *     ./adelbench 100000
+ *
+ * Every pass advances the virtual clock by a fixed step, so the numbers
+ * are repeatable from run to run. Compare them before and after changing
+ * the macros. Cycles come from the time stamp counter on x86, and so
+ * depend on the host's clock scaling; they are zero elsewhere.
+ *
+ ***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <new>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES() __rdtsc()
+#else
+#define CYCLES() 0
+#endif
+
+#include <adel.h>
+
+HardwareSerial Serial;
+
+// ------------------------------------------------------------
+//   Heap accounting
+
+static unsigned long heap_allocs = 0;
+static size_t heap_live = 0;
+static size_t heap_peak = 0;
+
+// -- Each block is preceded by its size, so delete knows how much to free
+union BlockHeader {
+  size_t size;
+  max_align_t align;
+};
+
+void * operator new(size_t size)
+{
+  BlockHeader * h = (BlockHeader *) malloc(sizeof(BlockHeader) + size);
+  if ( ! h) throw std::bad_alloc();
+  h->size = size;
+  heap_allocs++;
+  heap_live += size;
+  if (heap_live > heap_peak) heap_peak = heap_live;
+  return h + 1;
+}
+
+void operator delete(void * p) noexcept
+{
+  if ( ! p) return;
+  BlockHeader * h = ((BlockHeader *) p) - 1;
+  heap_live -= h->size;
+  free(h);
+}
+
+void operator delete(void * p, size_t) noexcept
+{
+  operator delete(p);
+}
+
+// ------------------------------------------------------------
+//   Workloads
+
+int counter = 0;
+
+// -- Blink forever
+adel blink(int pin, int ms)
+{
+  abegin:
+  while (1) {
+    digitalWrite(pin, HIGH);
+    adelay(ms);
+    digitalWrite(pin, LOW);
+    adelay(ms);
+  }
+  aend;
+}
+
+// -- A chain of andthen calls, depth deep, that finishes after 1ms. Run
+//    over and over, so it also measures creating and deleting ARs.
+adel chain(int depth)
+{
+  abegin:
+  if (depth == 0) {
+    adelay(1);
+  } else {
+    andthen( chain(depth - 1) );
+  }
+  aend;
+}
+
+// -- Binary tree of aboth, with blinking leaves
+adel tree2(int depth, int pin)
+{
+  abegin:
+  if (depth == 0) {
+    andthen( blink(pin, 1 + pin % 7) );
+  } else {
+    aboth( tree2(depth - 1, pin * 2), tree2(depth - 1, pin * 2 + 1) );
+  }
+  aend;
+}
+
+// -- Ternary tree of athree, with blinking leaves
+adel tree3(int depth, int pin)
+{
+  abegin:
+  if (depth == 0) {
+    andthen( blink(pin, 1 + pin % 7) );
+  } else {
+    athree( tree3(depth - 1, pin * 3), tree3(depth - 1, pin * 3 + 1), tree3(depth - 1, pin * 3 + 2) );
+  }
+  aend;
+}
+
+// -- Switch back and forth on every pass
+adel ping()
+{
+  abegin:
+  while (1) {
+    counter++;
+    ayourturn;
+  }
+  aend;
+}
+
+adel pingpong()
+{
+  abegin:
+  alternate( ping(), ping() );
+  aend;
+}
+
+// -- One function that stops at a different place on every pass, so each
+//    pass measures the cost of resuming it (build with ADEL_LINE_PCS to
+//    compare with the old numbering; see "make compare")
+adel resumer()
+{
+  abegin:
+  while (1) {
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+    ayieldif( true );
+  }
+  aend;
+}
+
+// -- Two short children, started over and over, either on the heap
+//    (aboth) or in slots inside the parent's AR (afork)
+aforkable pulse(int pin, int ms)
+{
+  abegin:
+  digitalWrite(pin, HIGH);
+  adelay(ms);
+  digitalWrite(pin, LOW);
+  aend;
+}
+
+adel heappair()
+{
+  abegin:
+  while (1) {
+    aboth( pulse(1, 1), pulse(2, 2) );
+  }
+  aend;
+}
+
+adel forkpair()
+{
+  aforkslots( kids, pulse, pulse );
+  abegin:
+  while (1) {
+    afork( kids, pulse(1, 1), pulse(2, 2) );
+  }
+  aend;
+}
+
+// -- An LED fading up and down on a gamma curve
+adel gammafade()
+{
+  int v = 0;
+  abegin:
+  while (1) {
+    aramp_ease(200, v, 0, 255, AdelEase::AGAMMA) {
+      analogWrite(9, v);
+      adelay(1);
+    }
+    aramp_ease(200, v, 255, 0, AdelEase::AGAMMA) {
+      analogWrite(9, v);
+      adelay(1);
+    }
+  }
+  aend;
+}
+
+// -- Lots of functions, almost always asleep
+adel sleeper(int k)
+{
+  abegin:
+  while (1) {
+    counter++;
+    adelay(100 + k % 900);
+  }
+  aend;
+}
+
+adel sleepers(int n)
+{
+  int i = 0;
+  abegin:
+  aall( i, n, sleeper(i) );
+  aend;
+}
+
+// -- Alternate with a loser that cleans up when stopped
+static int loser_stops = 0;
+static int stops_seen = -1;
+
+adel winner()
+{
+  abegin:
+  ayieldif(true);
+  ayieldif(true);
+  aend;
+}
+
+adel loser()
+{
+  abegin:
+  aonstop { loser_stops++; }
+  while (1) {
+    ayieldif(true);
+  }
+  aend;
+}
+
+adel altstop()
+{
+  abegin:
+  alternate( winner(), loser() );
+  stops_seen = loser_stops;
+  aend;
+}
+
+// -- A periodic function whose third run takes 85 ms, recording when
+//    each run starts
+static uint32_t period_starts[3][16];
+static int period_runs[3];
+
+adel periodrun(int pol)
+{
+  abegin:
+  if (period_runs[pol] < 16)
+    period_starts[pol][period_runs[pol]] = millis();
+  period_runs[pol]++;
+  if (period_runs[pol] == 3) {
+    adelay(85);
+  }
+  aend;
+}
+
+// -- The top-level functions, each with its own runtime
+static void run_chain() { arepeat( chain(32) ); }
+static void run_tree2() { arepeat( tree2(6, 1) ); }
+static void run_tree3() { arepeat( tree3(4, 1) ); }
+static void run_pingpong() { arepeat( pingpong() ); }
+static void run_sleepers() { arepeat( sleepers(1000) ); }
+static void run_resumer() { arepeat( resumer() ); }
+static void run_heappair() { arepeat( heappair() ); }
+static void run_forkpair() { arepeat( forkpair() ); }
+static void run_gammafade() { arepeat( gammafade() ); }
+
+// ------------------------------------------------------------
+//   Driver
+
+struct Workload {
+  const char * name;
+  void (*loop)();
+};
+
+static const Workload workloads[] = {
+  { "andthen chain x32", run_chain },
+  { "aboth tree 64 leaves", run_tree2 },
+  { "athree tree 81 leaves", run_tree3 },
+  { "alternate ping-pong", run_pingpong },
+  { "1000 adelay sleepers", run_sleepers },
+  { "resume, 32 steps", run_resumer },
+  { "aboth pair, restarted", run_heappair },
+  { "afork pair, restarted", run_forkpair },
+  { "aramp_ease gamma fade", run_gammafade },
+};
+
+// -- A gamma fade down must be the fade up played backward (so it dims
+//    at the same rate the other brightens), and both must hit their ends
+static bool check_gamma()
+{
+  const long ONE = AdelEase::ONE;
+  for (long p = 0; p <= ONE; p += 256) {
+    long up = AdelEase::value(AdelEase::AGAMMA, 0, 255, ONE - p);
+    long down = AdelEase::value(AdelEase::AGAMMA, 255, 0, p);
+    if (up != down) {
+      printf("gamma fade down at phase %ld: %ld, fade up gives %ld\n", p, down, up);
+      return false;
+    }
+  }
+  return AdelEase::value(AdelEase::AGAMMA, 255, 0, 0) == 255 &&
+    AdelEase::value(AdelEase::AGAMMA, 255, 0, ONE / 2) < 64;
+}
+
+// -- Virtual time per pass
+static const uint64_t STEP_US = 100;
+
+// -- When alternate finishes, the loser must be stopped (running its
+//    aonstop) right then, not when the caller finishes
+static bool check_alternate()
+{
+  for (int p = 0; p < 100 && stops_seen < 0; p++) {
+    aonce( altstop() );
+    adel_mock_advance(STEP_US);
+  }
+  return stops_seen == 1 && loser_stops == 1;
+}
+
+// -- With a 10 ms period, the run that should start at 30 ms can only
+//    start at 105 ms, having missed 7 periods whatever the policy.
+//    ACATCHUP then starts the runs for 30 to 100 ms back to back,
+//    ASKIP waits for 110 ms, and AASAP starts one at once and another
+//    10 ms after it.
+static AdelPeriod catchup_period(10, AdelPeriod::ACATCHUP);
+static AdelPeriod skip_period(10, AdelPeriod::ASKIP);
+static AdelPeriod asap_period(10, AdelPeriod::AASAP);
+
+static void run_catchup() { aperiodic( catchup_period, periodrun(0) ); }
+static void run_skip() { aperiodic( skip_period, periodrun(1) ); }
+static void run_asap() { aperiodic( asap_period, periodrun(2) ); }
+
+static bool check_period()
+{
+  static const uint32_t expect[3][5] = {
+    { 0, 10, 20, 105, 105 },
+    { 0, 10, 20, 110, 120 },
+    { 0, 10, 20, 105, 115 },
+  };
+  AdelPeriod * periods[3] = { & catchup_period, & skip_period, & asap_period };
+  void (*loops[3])() = { run_catchup, run_skip, run_asap };
+
+  for (int pol = 0; pol < 3; pol++) {
+    uint64_t start = adel_mock_clock();
+    while (adel_mock_clock() - start < 150000) {
+      loops[pol]();
+      adel_mock_advance(STEP_US);
+    }
+    for (int r = 0; r < 5; r++) {
+      uint32_t at = period_starts[pol][r] - (uint32_t) (start / 1000);
+      if (at != expect[pol][r]) {
+        printf("policy %d: run %d started at %u ms, not %u\n", pol, r,
+               (unsigned) at, (unsigned) expect[pol][r]);
+        return false;
+      }
+    }
+    if (periods[pol]->missed() != 7) {
+      printf("policy %d: missed %u periods, not 7\n", pol,
+             (unsigned) periods[pol]->missed());
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char ** argv)
+{
+  long passes = 200000;
+  if (argc > 1) passes = atol(argv[1]);
+
+  if ( ! check_gamma()) {
+    printf("gamma check failed\n");
+    return 1;
+  }
+
+  if ( ! check_period()) {
+    printf("period check failed\n");
+    return 1;
+  }
+
+  if ( ! check_alternate()) {
+    printf("alternate check failed: loser stopped %d times when it finished\n", stops_seen);
+    return 1;
+  }
+
+  printf("%-24s %10s %10s %12s %12s %10s\n",
+         "workload", "passes", "ns/pass", "cycles/pass", "allocs/pass", "peak heap");
+
+  for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+    heap_allocs = 0;
+    heap_peak = heap_live;
+    size_t heap_base = heap_live;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t c0 = CYCLES();
+    for (long p = 0; p < passes; p++) {
+      workloads[w].loop();
+      adel_mock_advance(STEP_US);
+    }
+    uint64_t c1 = CYCLES();
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    printf("%-24s %10ld %10.1f %12.1f %12.3f %10lu\n",
+           workloads[w].name, passes, ns / passes, (double) (c1 - c0) / passes,
+           (double) heap_allocs / passes,
+           (unsigned long) (heap_peak - heap_base));
+  }
+
+  return 0;
+}
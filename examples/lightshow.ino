@@ -23,23 +23,9 @@ void setup()
 
 adel getUserInput(char buffer[], uint8_t maxSize)
 {
-  uint8_t count;
-  
-  abegin:
-  // -- Wait for serial data  
-  await( Serial.available() != 0 );
-
-  // -- Fill the buffer
-  memset(buffer, 0, maxSize);
-  count = 0;
-  do {
-    // count += Serial.readBytes(buffer+count, maxSize);
-    buffer[count] = Serial.read();
-    count++;
-    adelay(10);
-  } while( (count < maxSize) && !(Serial.available() == 0) );
-
-  aend;
+  // -- Read a whole line, or whatever was typed if nothing more arrives
+  //    for 50ms (in case the terminal doesn't send line endings)
+  return areadline(Serial, buffer, maxSize + 1, 50);
 }
 
 adel blink(int pin, int interval)